@@ -0,0 +1,300 @@
+// Headless microbenchmarks of the visualizer's CPU work. Prints one JSON document with the time
+// per call of every benchmark at every size, for tracking regressions between releases.
+//
+//   Benchmarks [--filter=<name substring>] [--min-time=<seconds per measurement>]
+#define GLEW_NO_GLU
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include "AudioBands.h"
+#include "HeightController.h"
+#include "JobSystem.h"
+#include "TerrainGeneration.h"
+#include "TerrainLod.h"
+
+namespace {
+
+const int gridSizes[] = { 16, 24, 32, 64 };
+const int chunks = 8; // as in Application.cpp
+const double wavelength = 8.0;
+const int threadCounts[] = { 1, 2, 4, 8, 16, 32 }; // including the calling thread
+
+struct Result {
+	std::string name;
+	const char* sizeName;
+	int size;
+	long long iterations;
+	double nsPerCall;
+	double itemsPerSecond;
+};
+
+std::vector<Result> results;
+std::string filter;
+double minTime = 0.1;
+volatile double sink; // keeps results alive so the work is not optimized away
+
+bool selected(const std::string& name) {
+	return filter.empty() || name.find(filter) != std::string::npos;
+}
+
+// Runs body in batches that double until one takes minTime, then keeps the best of three
+// batches of that length. items is the work done by one call, for the throughput figure.
+template <typename Body>
+void measure(const std::string& name, const char* sizeName, int size, double items, Body body) {
+	if (!selected(name)) {
+		return;
+	}
+	typedef std::chrono::steady_clock Clock;
+	body();
+	long long batch = 1;
+	double seconds = 0.0;
+	while (true) {
+		Clock::time_point start = Clock::now();
+		for (long long i = 0; i < batch; i++) {
+			body();
+		}
+		seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		if (seconds >= minTime || batch >= (1LL << 40)) {
+			break;
+		}
+		batch *= 2;
+	}
+	double best = seconds;
+	for (int repeat = 0; repeat < 2; repeat++) {
+		Clock::time_point start = Clock::now();
+		for (long long i = 0; i < batch; i++) {
+			body();
+		}
+		best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
+	}
+	double nsPerCall = best * 1.0e9 / batch;
+	results.push_back({ name, sizeName, size, batch, nsPerCall, items * 1.0e9 / nsPerCall });
+	fprintf(stderr, "%-24s %s=%-5d %12.1f ns\n", name.c_str(), sizeName, size, nsPerCall);
+}
+
+void benchmarkNoise() {
+	siv::PerlinNoise perlin(1234);
+	for (int size : gridSizes) {
+		measure("perlin_noise", "gridSize", size, size * size, [&]() {
+			double sum = 0.0;
+			for (int i = 0; i < size; i++) {
+				for (int j = 0; j < size; j++) {
+					sum += perlin.noise(i / wavelength, j / wavelength);
+				}
+			}
+			sink = sum;
+		});
+		measure("perlin_octave_noise0_1", "gridSize", size, size * size, [&]() {
+			double sum = 0.0;
+			for (int i = 0; i < size; i++) {
+				for (int j = 0; j < size; j++) {
+					sum += perlin.octaveNoise0_1(i / wavelength, j / wavelength, 1);
+				}
+			}
+			sink = sum;
+		});
+	}
+}
+
+void benchmarkChunkGeneration() {
+	siv::PerlinNoise perlin(1234);
+	for (int size : gridSizes) {
+		std::vector<float> noise1(size * size), noise2(size * size), noise3(size * size);
+		double noiseRow = 0.0;
+		measure("chunk_generation", "gridSize", size, size * size, [&]() {
+			generateBandNoise(perlin, wavelength, noiseRow, size, noise1.data(), noise2.data(), noise3.data());
+			noiseRow = fmod(noiseRow + size - 1, 256.0 * wavelength);
+			sink = noise1[0];
+		});
+	}
+}
+
+// One large grid shared out by rows, for how generation scales with cores. Counts above the
+// machine's cores only measure the oversubscription.
+void benchmarkParallelChunkGeneration() {
+	const int size = 512;
+	const int rowsPerJob = 4;
+	siv::PerlinNoise perlin(1234);
+	std::vector<float> noise1(size * size), noise2(size * size), noise3(size * size);
+	for (int threads : threadCounts) {
+		if (!selected("parallel_chunk_generation")) {
+			return;
+		}
+		JobSystem pool(threads - 1);
+		double noiseRow = 0.0;
+		measure("parallel_chunk_generation", "threads", threads, size * size, [&]() {
+			pool.parallelFor("rows", 0, size, rowsPerJob, [&](int begin, int end, int) {
+				generateBandNoiseRows(perlin, wavelength, noiseRow, size, begin, end, noise1.data(), noise2.data(), noise3.data());
+			});
+			noiseRow = fmod(noiseRow + size - 1, 256.0 * wavelength);
+			sink = noise1[0];
+		});
+	}
+}
+
+// The CPU height compositing the software renderer does every frame, over every chunk
+void benchmarkHeightCompositing() {
+	siv::PerlinNoise perlin(1234);
+	for (int size : gridSizes) {
+		int vertices = size * size * chunks;
+		std::vector<float> noise1(vertices), noise2(vertices), noise3(vertices), heights(vertices);
+		for (int k = 0; k < chunks; k++) {
+			int first = k * size * size;
+			generateBandNoise(perlin, wavelength, k * (size - 1), size, &noise1[first], &noise2[first], &noise3[first]);
+		}
+		std::vector<double> peaks(size);
+		for (int i = 0; i < size; i++) {
+			peaks[i] = 1.0 + sin(3.141592653589 * i / (size - 1) * 3.0);
+		}
+		double low = 2.0, mid = 1.0, high = 0.5;
+		measure("height_compositing", "gridSize", size, vertices, [&]() {
+			for (int v = 0; v < vertices; v++) {
+				heights[v] = (float)compositeHeight(peaks[v % size], low, mid, high, noise1[v], noise2[v], noise3[v]);
+			}
+			low += 1.0e-9;
+			sink = heights[vertices / 2];
+		});
+	}
+}
+
+void benchmarkIndexGeneration() {
+	for (int size : gridSizes) {
+		std::vector<unsigned short> indices;
+		measure("index_generation", "gridSize", size, (size - 1) * (size - 1) * 2 * chunks, [&]() {
+			indices.clear();
+			for (int k = 0; k < chunks; k++) {
+				appendGridIndices(size, size * size * k, indices);
+			}
+			sink = indices.back();
+		});
+		// Every level of detail variant, including the vertex cache reordering
+		measure("lod_mesh_build", "gridSize", size, (size - 1) * (size - 1) * 2, [&]() {
+			ChunkLodSet lods;
+			lods.build(size);
+			sink = (double)lods.getIndices().size();
+		});
+	}
+}
+
+void benchmarkPidStep() {
+	const int controllerCounts[] = { 3, 64, 1024 };
+	for (int count : controllerCounts) {
+		std::vector<heightPIDController> controllers(count, heightPIDController(0.0));
+		int frame = 0;
+		// New targets every step, as the audio sets them, so the errors never settle to denormals
+		measure("pid_step", "controllers", count, count, [&]() {
+			double target = 1.0 + (frame++ & 7);
+			for (heightPIDController& controller : controllers) {
+				controller.setTarget(target);
+				controller.step();
+			}
+			sink = controllers[0].getValue();
+		});
+		HeightControllerBank bank(count);
+		frame = 0;
+		measure("pid_bank_step", "controllers", count, count, [&]() {
+			double target = 1.0 + (frame++ & 7);
+			for (int band = 0; band < count; band++) {
+				bank.setTarget(band, target);
+			}
+			bank.step(HeightControllerBank::referenceTimestep);
+			sink = bank.getValue(0);
+		});
+		HeightControllerBank springs(count);
+		for (int band = 0; band < count; band++) {
+			springs.setSpring(band, true, 8.0);
+		}
+		frame = 0;
+		// A tick rate other than 60 Hz, with its step factors cached after the first call
+		measure("spring_bank_step", "controllers", count, count, [&]() {
+			double target = 1.0 + (frame++ & 7);
+			for (int band = 0; band < count; band++) {
+				springs.setTarget(band, target);
+			}
+			springs.step(1.0 / 144.0);
+			sink = springs.getValue(0);
+		});
+	}
+}
+
+void benchmarkAudioBands() {
+	const int blockSizes[] = { 1024, 1764, 4096 };
+	for (int samples : blockSizes) {
+		AudioBands bands(samples, 44100.0);
+		std::vector<float> block(samples);
+		std::default_random_engine random(1234);
+		std::uniform_real_distribution<float> noise(-1.0f, 1.0f);
+		for (int i = 0; i < samples; i++) {
+			block[i] = 0.5f * (float)sin(2.0 * 3.141592653589 * 440.0 * i / 44100.0) + 0.1f * noise(random);
+		}
+		measure("audio_bands", "samples", samples, samples, [&]() {
+			float values[AudioBands::bandCount];
+			bands.analyze(block.data(), values);
+			sink = values[0];
+		});
+	}
+
+	// A whole recording's blocks at once, as analyzeAudio() does
+	const int blockCount = 256;
+	const int samples = 1764;
+	std::vector<float> recording(blockCount * samples);
+	std::default_random_engine random(1234);
+	std::uniform_real_distribution<float> noise(-1.0f, 1.0f);
+	for (size_t i = 0; i < recording.size(); i++) {
+		recording[i] = 0.5f * (float)sin(2.0 * 3.141592653589 * 440.0 * i / 44100.0) + 0.1f * noise(random);
+	}
+	std::vector<float> values(blockCount * AudioBands::bandCount);
+	for (int threads : threadCounts) {
+		if (!selected("parallel_audio_bands")) {
+			return;
+		}
+		JobSystem pool(threads - 1);
+		AudioBands bands(samples, 44100.0);
+		measure("parallel_audio_bands", "threads", threads, blockCount * samples, [&]() {
+			bands.analyzeBlocks(recording.data(), blockCount, values.data(), pool);
+			sink = values[0];
+		});
+	}
+}
+
+void printJson() {
+	printf("{\n  \"benchmarks\": [\n");
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result& r = results[i];
+		printf("    { \"name\": \"%s\", \"%s\": %d, \"iterations\": %lld, \"nsPerCall\": %.1f, \"itemsPerSecond\": %.0f }%s\n",
+			r.name.c_str(), r.sizeName, r.size, r.iterations, r.nsPerCall, r.itemsPerSecond, i + 1 < results.size() ? "," : "");
+	}
+	printf("  ]\n}\n");
+}
+
+}
+
+int main(int argc, char** argv) {
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--filter=", 9) == 0) {
+			filter = argv[i] + 9;
+		}
+		else if (strncmp(argv[i], "--min-time=", 11) == 0) {
+			minTime = atof(argv[i] + 11);
+		}
+		else {
+			fprintf(stderr, "Usage: %s [--filter=<name substring>] [--min-time=<seconds>]\n", argv[0]);
+			return 1;
+		}
+	}
+	benchmarkNoise();
+	benchmarkChunkGeneration();
+	benchmarkParallelChunkGeneration();
+	benchmarkHeightCompositing();
+	benchmarkIndexGeneration();
+	benchmarkPidStep();
+	benchmarkAudioBands();
+	printJson();
+	return 0;
+}
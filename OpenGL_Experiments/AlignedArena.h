@@ -0,0 +1,271 @@
+#pragma once
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <type_traits>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// Storage that is sized once at startup and then only written in place, handed out from a few
+// large blocks. Every array starts on its own 64 byte cache line, so no two arrays share a
+// line between threads and vector loads over them are aligned. Arrays are not freed one at a
+// time: reset() makes the whole arena free again and keeps the blocks, so allocating the same
+// sizes again takes nothing from the system. Not thread safe; allocate before handing the
+// arrays to other threads.
+class AlignedArena {
+public:
+	static const size_t alignment = 64;
+	static const size_t hugePageBytes = 2 << 20;
+
+	explicit AlignedArena(size_t blockBytes = 1 << 20) : blockBytes(blockBytes) {}
+
+	~AlignedArena() {
+		releaseBlocks();
+	}
+
+	AlignedArena(const AlignedArena&) = delete;
+	AlignedArena& operator=(const AlignedArena&) = delete;
+
+	// Backs the blocks with huge pages where the system grants them: on Windows that takes the
+	// "Lock pages in memory" privilege, on Linux reserved huge pages or else transparent ones.
+	// Without them the blocks use normal pages. Changing the setting returns the blocks already
+	// reserved so the next allocations take new ones, so like reset() it needs every array
+	// allocated so far to be out of use.
+	void setHugePages(bool enabled) {
+		if (enabled != hugePages) {
+			releaseBlocks();
+		}
+		hugePages = enabled;
+	}
+
+	// Returns NULL if the system is out of memory
+	void* allocate(size_t bytes) {
+		bytes = (bytes + alignment - 1) & ~(alignment - 1);
+		while (current < blocks.size() && blocks[current].used + bytes > blocks[current].size) {
+			current++;
+		}
+		if (current == blocks.size() && !reserveBlock(std::max(bytes, blockBytes))) {
+			return NULL;
+		}
+		Block& block = blocks[current];
+		void* memory = block.base + block.used;
+		block.used += bytes;
+		used += bytes;
+		peak = std::max(peak.load(), used.load());
+		return memory;
+	}
+
+	template <typename T>
+	T* allocateArray(size_t count) {
+		static_assert(std::is_trivially_copyable<T>::value, "arena arrays are never constructed or destroyed");
+		return static_cast<T*>(allocate(count * sizeof(T)));
+	}
+
+	// Every array allocated so far must no longer be used
+	void reset() {
+		for (Block& block : blocks) {
+			block.used = 0;
+		}
+		current = 0;
+		used = 0;
+	}
+
+	// Bytes handed out, including the padding to whole cache lines
+	size_t getBytesUsed() const {
+		return used;
+	}
+
+	size_t getPeakBytes() const {
+		return peak;
+	}
+
+	size_t getBytesReserved() const {
+		return reserved;
+	}
+
+	// Whether every block is on huge pages
+	bool onHugePages() const {
+		return reserved > 0 && hugeReserved == reserved;
+	}
+
+private:
+	struct Block {
+		char* base = NULL;
+		size_t size = 0;
+		size_t used = 0;
+		bool mapped = false; // from the page allocator rather than the heap
+	};
+
+	bool reserveBlock(size_t bytes) {
+		Block block;
+		if (hugePages) {
+			reserveHuge(block, bytes);
+		}
+		if (!block.base) {
+			block.size = (bytes + alignment - 1) & ~(alignment - 1);
+#ifdef _WIN32
+			block.base = (char*)_aligned_malloc(block.size, alignment);
+#else
+			void* memory = NULL;
+			block.base = posix_memalign(&memory, alignment, block.size) == 0 ? (char*)memory : NULL;
+#endif
+		}
+		if (!block.base) {
+			fprintf(stderr, "Could not reserve %zu bytes of terrain storage\n", bytes);
+			return false;
+		}
+		blocks.push_back(block);
+		reserved += block.size;
+		if (block.mapped) {
+			hugeReserved += block.size;
+		}
+		return true;
+	}
+
+	static void reserveHuge(Block& block, size_t bytes) {
+#ifdef _WIN32
+		size_t pageBytes = GetLargePageMinimum();
+		if (pageBytes == 0 || !enableLockMemoryPrivilege()) {
+			return;
+		}
+		block.size = (bytes + pageBytes - 1) / pageBytes * pageBytes;
+		block.base = (char*)VirtualAlloc(NULL, block.size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+#else
+		block.size = (bytes + hugePageBytes - 1) / hugePageBytes * hugePageBytes;
+		void* memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+		memory = mmap(NULL, block.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+#ifdef MADV_HUGEPAGE
+		if (memory == MAP_FAILED) {
+			memory = mmap(NULL, block.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (memory != MAP_FAILED && madvise(memory, block.size, MADV_HUGEPAGE) != 0) {
+				munmap(memory, block.size);
+				memory = MAP_FAILED;
+			}
+		}
+#endif
+		block.base = memory == MAP_FAILED ? NULL : (char*)memory;
+#endif
+		block.mapped = block.base != NULL;
+	}
+
+#ifdef _WIN32
+	// Large pages need the privilege both granted to the user and enabled in the process
+	static bool enableLockMemoryPrivilege() {
+		HANDLE token;
+		if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+			return false;
+		}
+		TOKEN_PRIVILEGES privileges = {};
+		privileges.PrivilegeCount = 1;
+		privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+		bool enabled = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)
+			&& AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) && GetLastError() == ERROR_SUCCESS;
+		CloseHandle(token);
+		return enabled;
+	}
+#endif
+
+	void releaseBlocks() {
+		for (Block& block : blocks) {
+			release(block);
+		}
+		blocks.clear();
+		current = 0;
+		used = 0;
+		reserved = 0;
+		hugeReserved = 0;
+	}
+
+	static void release(Block& block) {
+#ifdef _WIN32
+		if (block.mapped) {
+			VirtualFree(block.base, 0, MEM_RELEASE);
+		}
+		else {
+			_aligned_free(block.base);
+		}
+#else
+		if (block.mapped) {
+			munmap(block.base, block.size);
+		}
+		else {
+			free(block.base);
+		}
+#endif
+	}
+
+	size_t blockBytes;
+	bool hugePages = false;
+	std::vector<Block> blocks;
+	size_t current = 0; // the block allocations are taken from; the ones before it are full
+	// Read by other threads for the statistics
+	std::atomic<size_t> used{ 0 };
+	std::atomic<size_t> peak{ 0 };
+	std::atomic<size_t> reserved{ 0 };
+	std::atomic<size_t> hugeReserved{ 0 };
+};
+
+// An array of count Ts in an arena, used like the std::vector it replaces except that it never
+// changes size. Its contents start out undefined.
+template <typename T>
+class ArenaArray {
+public:
+	bool allocate(AlignedArena& arena, size_t count) {
+		items = arena.allocateArray<T>(count);
+		itemCount = items ? count : 0;
+		return items != NULL;
+	}
+
+	T& operator[](size_t i) {
+		return items[i];
+	}
+
+	const T& operator[](size_t i) const {
+		return items[i];
+	}
+
+	T* data() {
+		return items;
+	}
+
+	const T* data() const {
+		return items;
+	}
+
+	size_t size() const {
+		return itemCount;
+	}
+
+	T* begin() {
+		return items;
+	}
+
+	T* end() {
+		return items + itemCount;
+	}
+
+	const T* begin() const {
+		return items;
+	}
+
+	const T* end() const {
+		return items + itemCount;
+	}
+
+private:
+	T* items = NULL;
+	size_t itemCount = 0;
+};
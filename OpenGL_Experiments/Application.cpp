@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <float.h>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
@@ -7,33 +8,138 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <random>
 #include <time.h>
 #include <thread>
 #include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <PerlinNoise.hpp>
 #include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+#include "AlignedArena.h"
+#include "AudioBands.h"
+#include "AudioLatency.h"
+#include "ChunkCulling.h"
+#include "ChunkNoiseCompute.h"
+#include "DisplacedVertexCache.h"
+#include "FrameCapture.h"
+#include "FrameTimer.h"
+#include "HeightController.h"
+#include "JobSystem.h"
+#include "ProgramCache.h"
+#include "RenderState.h"
+#include "SessionRecording.h"
+#include "ShaderProgram.h"
+#include "SoftwareRasterizer.h"
+#include "TerrainGeneration.h"
+#include "TerrainLod.h"
+#include "Trace.h"
+#include "VertexCacheOptimizer.h"
+#include "WireframeBenchmark.h"
 using namespace glm;
 
 const int noiseSize = 24;
 const double windowWidth = 1920;//1024; 1920
 const double windowHeight = 1080;// 576; 1080
+const double replayTimestep = 1.0 / 60.0; // seconds per frame when replaying a session
+
+// The height controllers' bands, numbered as setHeightGains() and setHeightSpring() take them
+enum HeightBand { BandLow, BandMid, BandHigh, HeightBandCount };
+
+// Keys the camera and colour controls read. The order is part of the session recording format.
+enum InputKey { KeyW, KeyS, KeyD, KeyA, KeySpace, KeyLeftShift, KeyR, KeyF, KeyU, KeyJ, KeyI, KeyK, KeyO, KeyL, KeyQ, KeyE, InputKeyCount };
+const int inputKeyCodes[InputKeyCount] = {
+	GLFW_KEY_W, GLFW_KEY_S, GLFW_KEY_D, GLFW_KEY_A, GLFW_KEY_SPACE, GLFW_KEY_LEFT_SHIFT, GLFW_KEY_R, GLFW_KEY_F,
+	GLFW_KEY_U, GLFW_KEY_J, GLFW_KEY_I, GLFW_KEY_K, GLFW_KEY_O, GLFW_KEY_L, GLFW_KEY_Q, GLFW_KEY_E
+};
 const int chunks = 8;
 
+enum WireframeMode { WireframeTwoPass, WireframeSinglePass, WireframeEdgeLines, WireframeModeCount };
+
+// NDC depth bias of the GL_LINES edge pass, standing in for glPolygonOffset(-1, -1)
+const float lineDepthBias = 0.0002f;
+
+std::string getFrameUniformsString() {
+	return
+		"layout(std140) uniform FrameUniforms {\n"
+		"	mat4 MVP;\n"
+		"	vec4 shaderColor;\n"
+		"	float drawCol;\n"
+		"	float lineCol;\n"
+		"	vec2 viewportSize;\n"
+		"	vec4 bandAmplitudes;\n"
+		"	float depthBias;\n"
+		"};\n";
+}
+
+// Inputs and displace() shared by the vertex shaders that composite the terrain heights
+std::string getDisplacementString() {
+	return
+		"layout(location = 0) in vec2 gridPosition;\n"
+		"layout(location = 1) in vec2 chunkInstance; // z origin, ring row of the chunk's first row\n"
+		"uniform sampler2D noiseRing; // band noise and peak profile, rows wrap around\n"
+
+		+ getFrameUniformsString() +
+
+		"vec3 displace() {\n"
+		"	vec2 texel = gridPosition + vec2(" + std::to_string(noiseSize / 2) + ".0, chunkInstance.y + " + std::to_string(noiseSize / 2) + ".0) + 0.5;\n"
+		"	vec4 noise = texture(noiseRing, texel / vec2(textureSize(noiseRing, 0)));\n"
+		"	float height = noise.w * dot(bandAmplitudes.xyz, noise.xyz);\n"
+		"	return vec3(gridPosition.x, height, gridPosition.y + chunkInstance.x);\n"
+		"}\n";
+}
+
 std::string getVertexShaderString() {
 	return
 		"#version 330 core\n"
-		"layout(location = 0) in vec3 vertexPosition_modelspace;\n"
-		"//layout(location = 1) in vec3 vertexColor;\n"
 
-		"uniform mat4 MVP;\n"
-		"uniform float drawCol;\n"
+		+ getDisplacementString() +
 
 		"out float fragmentColor;\n"
 		"out float zPos;\n"
 
 		"void main() {\n"
+		"	vec3 vertexPosition_modelspace = displace();\n"
 		"	// Output position of the vertex, in clip space : MVP * position\n"
 		"	gl_Position = MVP * vec4(vertexPosition_modelspace, 1);\n"
+		"	gl_Position.z -= depthBias * gl_Position.w;\n"
+		"	fragmentColor = drawCol;\n"
+		"	zPos = vertexPosition_modelspace.y;\n"
+		"}";
+}
+
+// Captured by transform feedback, once per frame, when displaced vertices are cached
+std::string getDisplaceFeedbackShaderString() {
+	return
+		"#version 330 core\n"
+
+		+ getDisplacementString() +
+
+		"out vec4 displacedPosition;\n"
+
+		"void main() {\n"
+		"	displacedPosition = vec4(displace(), 1.0);\n"
+		"}";
+}
+
+// Draws from the cached displaced vertices; outputs match getVertexShaderString()
+std::string getCachedVertexShaderString() {
+	return
+		"#version 330 core\n"
+		"layout(location = 0) in float chunkIndex;\n"
+		"uniform samplerBuffer displacedVertices; // every grid vertex of every chunk\n"
+
+		+ getFrameUniformsString() +
+
+		"out float fragmentColor;\n"
+		"out float zPos;\n"
+
+		"void main() {\n"
+		"	vec4 vertexPosition_modelspace = texelFetch(displacedVertices, int(chunkIndex) * " + std::to_string(noiseSize * noiseSize) + " + gl_VertexID);\n"
+		"	gl_Position = MVP * vertexPosition_modelspace;\n"
+		"	gl_Position.z -= depthBias * gl_Position.w;\n"
 		"	fragmentColor = drawCol;\n"
 		"	zPos = vertexPosition_modelspace.y;\n"
 		"}";
@@ -46,66 +152,204 @@ std::string getFragmentShaderString() {
 		"in float zPos;\n"
 		"out vec4 color;\n"
 
-		"uniform float rAmt;\n"
-		"uniform float gAmt;\n"
-		"uniform float bAmt;\n"
+		+ getFrameUniformsString() +
 
 		"void main() {\n"
 		"	float colAmount = fragmentColor + 0.13 * zPos;\n"
-		"	color = vec4(colAmount * rAmt, colAmount * gAmt, colAmount * bAmt, colAmount * 1.5);//fragmentColor;\n"
+		"	color = vec4(colAmount * shaderColor.rgb, colAmount * 1.5);//fragmentColor;\n"
 		"}\n";
 }
 
-GLuint LoadShaders() {
+// Single pass wireframe: the distance of each fragment to the triangle edges, in pixels
+std::string getWireframeGeometryShaderString() {
+	return
+		"#version 330 core\n"
+		"layout(triangles) in;\n"
+		"layout(triangle_strip, max_vertices = 3) out;\n"
+
+		+ getFrameUniformsString() +
 
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+		"in float fragmentColor[];\n"
+		"in float zPos[];\n"
+		"out float wireColor;\n"
+		"out float wireZPos;\n"
+		"noperspective out vec3 edgeDistance;\n"
 
-	// Read the Vertex Shader code
-	std::string VertexShaderCode = getVertexShaderString();
+		"void main() {\n"
+		"	vec2 p[3];\n"
+		"	bool behindCamera = false;\n"
+		"	for (int i = 0; i < 3; i++) {\n"
+		"		behindCamera = behindCamera || gl_in[i].gl_Position.w <= 0.0;\n"
+		"		p[i] = gl_in[i].gl_Position.xy / gl_in[i].gl_Position.w * 0.5 * viewportSize;\n"
+		"	}\n"
+		"	float area = abs((p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[2].x - p[0].x) * (p[1].y - p[0].y));\n"
+		"	vec3 heights = vec3(area / length(p[2] - p[1]), area / length(p[2] - p[0]), area / length(p[1] - p[0]));\n"
+		"	// Projected distances are meaningless once a vertex is behind the camera, so skip the edges\n"
+		"	if (behindCamera) heights = vec3(1.0e6);\n"
+		"	for (int i = 0; i < 3; i++) {\n"
+		"		gl_Position = gl_in[i].gl_Position;\n"
+		"		wireColor = fragmentColor[i];\n"
+		"		wireZPos = zPos[i];\n"
+		"		edgeDistance = vec3(0.0);\n"
+		"		edgeDistance[i] = heights[i];\n"
+		"		EmitVertex();\n"
+		"	}\n"
+		"	EndPrimitive();\n"
+		"}\n";
+}
+
+std::string getWireframeFragmentShaderString() {
+	return
+		"#version 330 core\n"
+		"in float wireColor;\n"
+		"in float wireZPos;\n"
+		"noperspective in vec3 edgeDistance;\n"
+		"out vec4 color;\n"
+
+		+ getFrameUniformsString() +
+
+		"const float lineHalfWidth = 1.0; // glLineWidth(2.0) in the two pass mode\n"
+
+		"void main() {\n"
+		"	float fillAmount = wireColor + 0.13 * wireZPos;\n"
+		"	float lineAmount = lineCol + 0.13 * wireZPos;\n"
+		"	vec4 fill = clamp(vec4(fillAmount * shaderColor.rgb, fillAmount * 1.5), 0.0, 1.0);\n"
+		"	vec4 line = clamp(vec4(lineAmount * shaderColor.rgb, lineAmount * 1.5), 0.0, 1.0);\n"
+		"	float distance = min(edgeDistance.x, min(edgeDistance.y, edgeDistance.z));\n"
+		"	float coverage = clamp(lineHalfWidth + 0.5 - distance, 0.0, 1.0);\n"
+		"	// Premultiplied with alpha 1, so additive blending adds what the fill and line passes would\n"
+		"	color = vec4(fill.rgb * fill.a + coverage * line.rgb * line.a, 1.0);\n"
+		"}\n";
+}
+
+// Writes a chunk's (n1, n2, n3, peak) texels into the noise ring, one invocation per texel.
+// Must produce the same values as generateBandNoise.
+std::string getChunkNoiseComputeShaderString() {
+	std::string n = std::to_string(noiseSize);
+	return
+		"#version 430 core\n"
+		"layout(local_size_x = " + n + ", local_size_y = " + n + ") in;\n"
+		"layout(std430, binding = 0) readonly buffer Permutation { int p[512]; };\n"
+		"layout(std430, binding = 1) writeonly buffer ChunkTexels { vec4 texels[]; }; // for readback\n"
+		"layout(rgba32f, binding = 0) uniform writeonly image2D noiseRing;\n"
+		"uniform double noiseRow; // first row of the chunk, wrapped to the noise period\n"
+		"uniform double wavelength;\n"
+		"uniform int firstRingRow;\n"
+		"uniform int texelOffset;\n"
+		"uniform float peaks[" + n + "];\n"
+
+		"// siv::PerlinNoise in double precision, for z = 0\n"
+		"double fade(double t) {\n"
+		"	return t * t * t * (t * (t * 6.0LF - 15.0LF) + 10.0LF);\n"
+		"}\n"
+		"double lerp(double t, double a, double b) {\n"
+		"	return a + t * (b - a);\n"
+		"}\n"
+		"double grad(int hash, double x, double y) {\n"
+		"	int h = hash & 15;\n"
+		"	double u = h < 8 ? x : y;\n"
+		"	double v = h < 4 ? y : h == 12 || h == 14 ? x : 0.0LF;\n"
+		"	return ((h & 1) == 0 ? u : -u) + ((h & 2) == 0 ? v : -v);\n"
+		"}\n"
+		"double noise0_1(double x, double y) {\n"
+		"	int X = int(floor(x)) & 255;\n"
+		"	int Y = int(floor(y)) & 255;\n"
+		"	x -= floor(x);\n"
+		"	y -= floor(y);\n"
+		"	double u = fade(x);\n"
+		"	double v = fade(y);\n"
+		"	int A = p[X] + Y;\n"
+		"	int B = p[X + 1] + Y;\n"
+		"	double value = lerp(v, lerp(u, grad(p[p[A]], x, y), grad(p[p[B]], x - 1.0LF, y)),\n"
+		"		lerp(u, grad(p[p[A + 1]], x, y - 1.0LF), grad(p[p[B + 1]], x - 1.0LF, y - 1.0LF)));\n"
+		"	return value * 0.5LF + 0.5LF;\n"
+		"}\n"
 
-	// Read the Fragment Shader code
-	std::string FragmentShaderCode = getFragmentShaderString();
+		"void main() {\n"
+		"	int column = int(gl_LocalInvocationID.x);\n"
+		"	int row = int(gl_LocalInvocationID.y);\n"
+		"	double i = double(row) + noiseRow;\n"
+		"	double j = double(column);\n"
+		"	vec4 texel = vec4(\n"
+		"		float(max(noise0_1(i / wavelength, j / wavelength) * 10.0LF - 4.0LF, 0.0LF) * 1.5LF),\n"
+		"		float(noise0_1(i / (wavelength / 2.0LF), j / (wavelength / 2.0LF)) * 5.0LF - 3.0LF),\n"
+		"		float(noise0_1(i / (wavelength / 4.0LF), j / (wavelength / 4.0LF)) * 4.0LF - 1.0LF),\n"
+		"		peaks[column]);\n"
+		"	imageStore(noiseRing, ivec2(column, (firstRingRow + row) % imageSize(noiseRing).y), texel);\n"
+		"	texels[texelOffset + column + row * " + n + "] = texel;\n"
+		"}\n";
+}
+
+GLuint CompileShader(GLenum ShaderType, const std::string& ShaderCode, const char* ShaderName) {
+	GLuint ShaderID = glCreateShader(ShaderType);
 
 	GLint Result = GL_FALSE;
 	int InfoLogLength;
 
-	// Compile Vertex Shader
-	printf("Compiling vertex shader\n");
-	char const* VertexSourcePointer = VertexShaderCode.c_str();
-	glShaderSource(VertexShaderID, 1, &VertexSourcePointer, NULL);
-	glCompileShader(VertexShaderID);
+	printf("Compiling %s shader\n", ShaderName);
+	char const* SourcePointer = ShaderCode.c_str();
+	glShaderSource(ShaderID, 1, &SourcePointer, NULL);
+	glCompileShader(ShaderID);
 
-	// Check Vertex Shader
-	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	glGetShaderiv(ShaderID, GL_COMPILE_STATUS, &Result);
+	glGetShaderiv(ShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
 	if (InfoLogLength > 0) {
-		std::vector<char> VertexShaderErrorMessage(InfoLogLength + 1);
-		glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-		printf("%s\n", &VertexShaderErrorMessage[0]);
+		std::vector<char> ShaderErrorMessage(InfoLogLength + 1);
+		glGetShaderInfoLog(ShaderID, InfoLogLength, NULL, &ShaderErrorMessage[0]);
+		printf("%s\n", &ShaderErrorMessage[0]);
 	}
+	return ShaderID;
+}
 
-	// Compile Fragment Shader
-	printf("Compiling fragment shader\n");
-	char const* FragmentSourcePointer = FragmentShaderCode.c_str();
-	glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer, NULL);
-	glCompileShader(FragmentShaderID);
+struct ShaderStage {
+	GLenum type;
+	const char* name;
+	std::string code;
+};
 
-	// Check Fragment Shader
-	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	if (InfoLogLength > 0) {
-		std::vector<char> FragmentShaderErrorMessage(InfoLogLength + 1);
-		glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-		printf("%s\n", &FragmentShaderErrorMessage[0]);
+// Each cacheName gets its own program binary cache file. feedbackVaryings are captured
+// interleaved by transform feedback.
+GLuint LoadProgram(const char* cacheName, const std::vector<ShaderStage>& stages, const std::vector<const char*>& feedbackVaryings = {}) {
+	TRACE_SCOPE("LoadProgram");
+	auto startTime = std::chrono::steady_clock::now();
+
+	// Try the program binary cache first
+	bool useCache = ProgramCache::isSupported();
+	std::vector<std::string> sources;
+	for (const ShaderStage& stage : stages) {
+		sources.push_back(stage.code);
+	}
+	ProgramCache cache(std::string("shader_cache_") + cacheName + ".bin", sources);
+	if (useCache) {
+		GLuint CachedProgramID = cache.load();
+		if (CachedProgramID != 0) {
+			printf("Loaded cached %s shader program in %.2f ms\n", cacheName,
+				std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count());
+			return CachedProgramID;
+		}
+	}
+
+	// Compile the shaders
+	std::vector<GLuint> ShaderIDs;
+	for (const ShaderStage& stage : stages) {
+		ShaderIDs.push_back(CompileShader(stage.type, stage.code, stage.name));
 	}
 
+	GLint Result = GL_FALSE;
+	int InfoLogLength;
+
 	// Link the program
 	printf("Linking program\n");
 	GLuint ProgramID = glCreateProgram();
-	glAttachShader(ProgramID, VertexShaderID);
-	glAttachShader(ProgramID, FragmentShaderID);
+	for (GLuint ShaderID : ShaderIDs) {
+		glAttachShader(ProgramID, ShaderID);
+	}
+	if (useCache) {
+		glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+	if (!feedbackVaryings.empty()) {
+		glTransformFeedbackVaryings(ProgramID, (GLsizei)feedbackVaryings.size(), feedbackVaryings.data(), GL_INTERLEAVED_ATTRIBS);
+	}
 	glLinkProgram(ProgramID);
 
 	// Check the program
@@ -117,15 +361,59 @@ GLuint LoadShaders() {
 		printf("%s\n", &ProgramErrorMessage[0]);
 	}
 
-	glDetachShader(ProgramID, VertexShaderID);
-	glDetachShader(ProgramID, FragmentShaderID);
+	for (GLuint ShaderID : ShaderIDs) {
+		glDetachShader(ProgramID, ShaderID);
+		glDeleteShader(ShaderID);
+	}
 
-	glDeleteShader(VertexShaderID);
-	glDeleteShader(FragmentShaderID);
+	if (Result != GL_TRUE) {
+		glDeleteProgram(ProgramID);
+		return 0;
+	}
+	if (useCache) {
+		cache.save(ProgramID);
+	}
+	printf("Compiled %s shader program in %.2f ms\n", cacheName,
+		std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count());
 
 	return ProgramID;
 }
 
+// GeometryShaderCode may be empty
+GLuint LoadShaders(const char* cacheName, const std::string& VertexShaderCode, const std::string& GeometryShaderCode, const std::string& FragmentShaderCode) {
+	std::vector<ShaderStage> stages;
+	stages.push_back({ GL_VERTEX_SHADER, "vertex", VertexShaderCode });
+	if (!GeometryShaderCode.empty()) {
+		stages.push_back({ GL_GEOMETRY_SHADER, "geometry", GeometryShaderCode });
+	}
+	stages.push_back({ GL_FRAGMENT_SHADER, "fragment", FragmentShaderCode });
+	return LoadProgram(cacheName, stages);
+}
+
+GLuint LoadShaders() {
+	return LoadShaders("terrain", getVertexShaderString(), "", getFragmentShaderString());
+}
+
+GLuint LoadCachedShaders() {
+	return LoadShaders("terrain_cached", getCachedVertexShaderString(), "", getFragmentShaderString());
+}
+
+GLuint LoadCachedWireframeShaders() {
+	return LoadShaders("wireframe_cached", getCachedVertexShaderString(), getWireframeGeometryShaderString(), getWireframeFragmentShaderString());
+}
+
+GLuint LoadDisplaceFeedbackShader() {
+	return LoadProgram("displace_feedback", { { GL_VERTEX_SHADER, "vertex", getDisplaceFeedbackShaderString() } }, { "displacedPosition" });
+}
+
+GLuint LoadChunkNoiseComputeShader() {
+	return LoadProgram("chunk_noise", { { GL_COMPUTE_SHADER, "compute", getChunkNoiseComputeShaderString() } });
+}
+
+GLuint LoadWireframeShaders() {
+	return LoadShaders("wireframe", getVertexShaderString(), getWireframeGeometryShaderString(), getWireframeFragmentShaderString());
+}
+
 class OpenGLProgram {
 private:
 	std::uint32_t seed;
@@ -138,79 +426,832 @@ private:
 	
 	std::thread glThread;
 	bool stopProgram = false;
-
-	std::vector<float> noise1;
-	std::vector<float> noise2;
-	std::vector<float> noise3;
-	GLfloat g_vertex_buffer_data[noiseSize * noiseSize * 3 * chunks];
+	FrameCapture frameCapture;
+	RenderState renderState;
+	FrameTimer frameTimer;
+	std::atomic<int> wireframeMode{ WireframeTwoPass };
+	std::atomic<bool> cacheDisplacedVertices{ false };
+	WireframeBenchmark wireframeBenchmark{ WireframeModeCount };
+
+	// The terrain arrays, allocated once per run from cache line aligned blocks
+	AlignedArena terrainArena;
+	std::atomic<bool> terrainHugePages{ false };
+	ArenaArray<float> noise1;
+	ArenaArray<float> noise2;
+	ArenaArray<float> noise3;
+	// Every chunk is an instance of one grid: (x, z) per vertex, shifted by the instance's
+	// (z origin, first ring row). Heights are composited in the vertex shader from a ring of
+	// noise rows that holds every live chunk; neighbouring chunks share their boundary row.
+	ArenaArray<GLfloat> gridVertices;
+	GLfloat chunkInstances[chunks * 2];
+	static const int ringRows = chunks * (noiseSize - 1) + 1;
+	ArenaArray<GLfloat> ringUpload; // (n1, n2, n3, peak) per texel of each chunk, staged for upload
+	unsigned int dirtyChunks = 0; // bit per chunk whose rows changed since the last upload
+	unsigned int dirtyInstances = 0; // bit per chunk whose instance changed since the last upload
+	ArenaArray<GLfloat> softwarePositions;
+	ArenaArray<unsigned short> indices; // full density, for the software renderer
+	ArenaArray<unsigned short> rowOrderIndices; // indices before vertex cache reordering
+	std::atomic<int> vertexCacheBenchmarkFrames{ 0 };
+	std::atomic<double> vertexCacheResults[4] = {}; // row order ms, reordered ms, row order ACMR, reordered ACMR
+	ChunkLodSet chunkLods; // chunk-relative index lists the GPU draws from
+
+	// Per-chunk noise extremes of each band and z origin, for bounding boxes
+	float noiseMin[3][chunks];
+	float noiseMax[3][chunks];
+	int64_t chunkZOrigin[chunks]; // world row
+	double peakMin, peakMax;
+	// Largest interpolation error of each band at each level of detail
+	float bandError[3][ChunkLodSet::levels][chunks];
+	int chunkLod[chunks];
+	std::atomic<float> lodErrorThreshold{ 1.0f }; // pixels
+	Frustum frustum;
+	DrawList triangleDraws;
+	DrawList lineDraws;
+	std::atomic<int> visibleChunks{ chunks };
+	std::atomic<int> drawnTriangles{ 0 };
+	siv::PerlinNoise perlin;
+	// On GL 4.3 new chunks are generated by a compute shader and read back for the CPU side
+	ChunkNoiseCompute noiseCompute;
+	bool computeNoise = false;
+	std::atomic<bool> allowComputeNoise{ true };
+	std::atomic<bool> checkComputeNoise{ false };
+	std::atomic<int> computeNoiseChecked{ 0 };
+	std::atomic<double> computeNoiseError{ 0.0 };
+	std::vector<GLfloat> computeTexels;
+	double peaksArray[noiseSize];
+	// Render space is rebased every rebaseRows rows so float positions stay small however long
+	// the terrain scrolls. originRow is the world row at render space z = 0; yoffset and chunk
+	// instances are relative to it.
+	static const int rebaseRows = 4096;
+	int64_t originRow = 0;
+	double yoffset = 0.0;
+	double yscrollspeed = 0.3;
+	int64_t ysteps = 0;
+
+	// Created on first use so the worker threads are not started while the module loads
+	std::unique_ptr<SoftwareRasterizer> softwareRasterizer;
+	std::mutex referenceImageMutex;
+	std::string referenceImagePath;
 	
-	class heightPIDController {
-	private:
-		double kP = 0.16;
-		double kI = 0.12;
-		double kD = 0.08;
-		double error = 0;
-		double totalError = 0;
-		double lastError = 0;
-		double value = 0;
-		double target = 0;
-
-	public:
-		heightPIDController(double initialValue) {
-			value = initialValue;
-		}
-		void setTarget(double a) {
-			target = a;
-		}
-		double getTarget() {
-			return target;
-		}
-		double getValue() {
-			return value;
-		}
-		void step() {
-			error = target - value;
-			totalError += error;
-			double p = kP * error;
-			double i = kI * totalError;
-			double d = kD * (error - lastError);
-			lastError = error;
-			totalError *= 0.8;
-			value += p + i + d;
-		}
-	};
-
-	heightPIDController mLow = heightPIDController(0.0);
-	heightPIDController mMid = heightPIDController(0.0);
-	heightPIDController mHi = heightPIDController(0.0);
+	// Counts setMountainHeight() calls, so a trace can link an audio block to the frame that shows it
+	std::atomic<uint64_t> heightTargetUpdates{ 0 };
+	uint64_t appliedHeightUpdate = 0;
+	AudioLatency audioLatency;
+
+	// Session recording starts with the render loop, so a replay starts from the same terrain
+	SessionWriter sessionWriter;
+	std::mutex sessionMutex;
+	std::string sessionPath;
+	// Replay of a session, loaded before the render thread starts
+	std::unique_ptr<SessionReader> sessionReplay;
+	bool replayRealtime = true;
+	SessionEvent replayEvent;
+	bool replayEventPending = false;
+	InputState replayInput;
+	std::atomic<int> replayFrames{ 0 };
+	std::atomic<double> replaySeconds{ 0.0 };
+	std::atomic<bool> replayFinished{ false };
+	std::thread impulseThread;
+	std::atomic<bool> stopImpulses{ false };
+
+	HeightControllerBank heights = HeightControllerBank(HeightBandCount);
+	std::mutex heightsMutex; // held while stepping or retuning the controllers, not for targets
+
+	// Worker threads shared by terrain generation and audio analysis, started on first use
+	std::unique_ptr<JobSystem> jobs;
+	std::mutex jobsMutex;
+	int workerThreads = -1; // one per core besides the render thread's
+	bool pinWorkerThreads = false;
+	// The first terrain is generated by jobs while the window, context and shaders are created
+	TaskGraph startupJobs;
+	int startupMesh = -1;
+	int startupChunks = -1;
+	enum StartupPhase { StartupFirstFrame, StartupContext, StartupBuffers, StartupShaders, StartupTerrainWait, StartupTerrainWork, StartupPhaseCount };
+	std::atomic<double> startupMilliseconds[StartupPhaseCount] = {};
+	std::chrono::steady_clock::time_point startupStart;
+	std::chrono::steady_clock::time_point startupLap;
+	bool firstFrameShown = false;
+	// The next frame's terrain is prepared by jobs while this one is drawn and swapped
+	TaskGraph frameJobs;
+	bool frameJobsRunning = false;
+	std::atomic<bool> overlapFrameJobs{ true };
+	int preparedRebase = 0;
+	int loadingChunk = -1; // chunk whose noise the frame's jobs generate, or -1
+
+	static const int rowsPerJob = 4;
+
+	JobSystem& getJobs() {
+		std::lock_guard<std::mutex> lock(jobsMutex);
+		if (!jobs) {
+			jobs.reset(new JobSystem(workerThreads, pinWorkerThreads));
+		}
+		return *jobs;
+	}
 
-public:
+	// The chunk's rows are shared out among the workers
+	void generateChunkRows(int arrayPos) {
+		int first = arrayPos * noiseSize * noiseSize;
+		double noiseRow = getNoiseRow(chunkZOrigin[arrayPos]);
+		getJobs().parallelFor("chunk rows", 0, noiseSize, rowsPerJob, [&](int begin, int end, int) {
+			generateBandNoiseRows(perlin, wavelength, noiseRow, noiseSize, begin, end, &noise1[first], &noise2[first], &noise3[first]);
+		});
+	}
 
-	void run() {
-		#pragma region Noise
-		fprintf(stderr, "Random seed is %d\n", seed);
+	void generateChunkNoise(int arrayPos, int64_t zOrigin) {
+		TRACE_SCOPE("generateChunkNoise");
+		int first = arrayPos * noiseSize * noiseSize;
+		generateBandNoise(perlin, wavelength, getNoiseRow(zOrigin), noiseSize, &noise1[first], &noise2[first], &noise3[first]);
+		updateChunkStats(arrayPos, zOrigin);
+	}
 
-		double yoffset = 0.0;
-		double yscrollspeed = 0.3;
-		int ysteps = 0;
+	// The noise repeats every 256 units of its input, so wrapping the row keeps the input small
+	// without changing the terrain
+	double getNoiseRow(int64_t zOrigin) {
+		return fmod((double)zOrigin, 256.0 * wavelength);
+	}
+
+	void updateChunkStats(int arrayPos, int64_t zOrigin) {
+		for (int b = 0; b < 3; b++) {
+			updateBandStats(arrayPos, b);
+		}
+		chunkZOrigin[arrayPos] = zOrigin;
+	}
+
+	// Noise extremes and level of detail errors of one of a chunk's bands
+	void updateBandStats(int arrayPos, int band) {
+		ArenaArray<float>* bands[3] = { &noise1, &noise2, &noise3 };
+		const float* values = &(*bands[band])[arrayPos * noiseSize * noiseSize];
+		noiseMin[band][arrayPos] = *std::min_element(values, values + noiseSize * noiseSize);
+		noiseMax[band][arrayPos] = *std::max_element(values, values + noiseSize * noiseSize);
+		for (int lod = 0; lod < ChunkLodSet::levels; lod++) {
+			bandError[band][lod][arrayPos] = ChunkLodSet::maxCellRange(values, noiseSize, lod);
+		}
+	}
+
+	// Stands in for the stats of a chunk the compute shader is still generating: bounds that hold
+	// for any noise sample, and full density
+	void setPendingChunkStats(int arrayPos, int64_t zOrigin) {
+		float bandBounds[3][2];
+		bandNoiseBounds(bandBounds);
+		for (int b = 0; b < 3; b++) {
+			noiseMin[b][arrayPos] = bandBounds[b][0];
+			noiseMax[b][arrayPos] = bandBounds[b][1];
+			for (int lod = 0; lod < ChunkLodSet::levels; lod++) {
+				bandError[b][lod][arrayPos] = lod == 0 ? 0.0f : FLT_MAX;
+			}
+		}
+		chunkZOrigin[arrayPos] = zOrigin;
+	}
+
+	// Every array the terrain is kept in, sized for the whole run so no frame allocates
+	bool allocateTerrain() {
+		const int vertices = noiseSize * noiseSize * chunks;
+		terrainArena.reset();
+		terrainArena.setHugePages(terrainHugePages);
+		bool allocated = noise1.allocate(terrainArena, vertices) && noise2.allocate(terrainArena, vertices) && noise3.allocate(terrainArena, vertices)
+			&& gridVertices.allocate(terrainArena, noiseSize * noiseSize * 2) && ringUpload.allocate(terrainArena, vertices * 4)
+			&& softwarePositions.allocate(terrainArena, vertices * 3) && indices.allocate(terrainArena, chunks * gridIndexCount(noiseSize))
+			&& rowOrderIndices.allocate(terrainArena, chunks * gridIndexCount(noiseSize));
+		printf("Terrain storage: %zu KB used of %zu KB reserved%s\n", terrainArena.getBytesUsed() / 1024, terrainArena.getBytesReserved() / 1024,
+			terrainArena.onHugePages() ? " on huge pages" : "");
+		return allocated;
+	}
+
+	// What the startup jobs and the GL setup both read: the scroll, the column profile and where
+	// each chunk is placed
+	void resetTerrain() {
+		originRow = 0;
+		yoffset = 0.0;
+		ysteps = 0;
 
-		double peaksArray[noiseSize];
 		double pi = 3.141592653589;
 		for (int i = 0; i < noiseSize; i++) {
 			peaksArray[i] = 1.0 + sin(pi * i / (noiseSize - 1) * 3.0) - cos(pi * i / (noiseSize - 1) * 2.0) - sin(pi * i / (noiseSize - 1));
 		}
-		
-		const siv::PerlinNoise perlin(seed);
+		peakMin = *std::min_element(peaksArray, peaksArray + noiseSize);
+		peakMax = *std::max_element(peaksArray, peaksArray + noiseSize);
+
+		perlin.reseed(seed);
+		for (int k = 0; k < chunks; k++) {
+			chunkZOrigin[k] = k * (noiseSize - 1);
+			placeChunk(k);
+		}
+	}
+
+	void initTerrainChunks() {
+		getJobs().parallelFor("chunks", 0, chunks, 1, [&](int begin, int end, int) {
+			for (int k = begin; k < end; k++) {
+				generateChunkNoise(k, chunkZOrigin[k]);
+			}
+		});
 		for (int k = 0; k < chunks; k++) {
-			int koffset = k * (noiseSize - 1);
+			stageChunkRows(k);
+		}
+		dirtyChunks = (1u << chunks) - 1;
+	}
+
+	void initTerrainMesh() {
+		// Vertices
+		int index = 0;
+		for (int j = 0; j < noiseSize; j++) {
 			for (int i = 0; i < noiseSize; i++) {
-				for (int j = 0; j < noiseSize; j++) {
-					noise1.push_back(max(perlin.octaveNoise0_1((i + koffset) / wavelength, j / wavelength, 1) * 10 - 4, 0.0) * 1.5);
-					noise2.push_back(perlin.octaveNoise0_1((i + koffset) / (wavelength / 2), j / (wavelength / 2), 1) * 5.0 - 3.0);
-					noise3.push_back(perlin.octaveNoise0_1((i + koffset) / (wavelength / 4), j / (wavelength / 4), 1) * 4.0 - 1.0);
+				gridVertices[index] = i - noiseSize / 2;
+				index++;
+				gridVertices[index] = j - noiseSize / 2;
+				index++;
+			}
+		}
+
+		// Vertex indices
+		for (int k = 0; k < chunks; k++) {
+			writeGridIndices(noiseSize, noiseSize * noiseSize * k, &indices[k * gridIndexCount(noiseSize)]);
+		}
+		// Reordered in the same bands of rows as the GPU chunks so the draw stays front to back
+		std::copy(indices.begin(), indices.end(), rowOrderIndices.begin());
+		int bandIndices = ChunkLodSet::optimizeStrips * (noiseSize - 1) * 6;
+		for (int k = 0; k < chunks; k++) {
+			for (int row = 0; row < noiseSize - 1; row += ChunkLodSet::optimizeStrips) {
+				int first = (k * (noiseSize - 1) + row) * (noiseSize - 1) * 6;
+				int count = std::min(bandIndices, (noiseSize - 1 - row) * (noiseSize - 1) * 6);
+				VertexCacheOptimizer::optimize(&indices[first], count, noiseSize * noiseSize * chunks);
+			}
+		}
+		chunkLods.build(noiseSize);
+	}
+
+	void placeChunk(int arrayPos) {
+		chunkInstances[arrayPos * 2] = (GLfloat)(chunkZOrigin[arrayPos] - originRow);
+		chunkInstances[arrayPos * 2 + 1] = (GLfloat)(chunkZOrigin[arrayPos] % ringRows);
+		dirtyInstances |= 1u << arrayPos;
+	}
+
+	// Returns how far render space moved back along z, so the caller can move what it holds. A
+	// chunk that comes into range is left in loadingChunk for the frame's jobs to generate.
+	int scrollTerrain() {
+		loadingChunk = -1;
+		yoffset += yscrollspeed;
+		if (yoffset > (double)((ysteps + 1) * (noiseSize - 1) - originRow)) {
+			// Load a new chunk (move its instance and update noise)
+			int arrayPos = ysteps % chunks;
+			int64_t zOrigin = (ysteps + chunks) * (noiseSize - 1);
+			if (computeNoise) {
+				setPendingChunkStats(arrayPos, zOrigin);
+			}
+			else {
+				chunkZOrigin[arrayPos] = zOrigin;
+				loadingChunk = arrayPos;
+			}
+			placeChunk(arrayPos);
+			dirtyChunks |= 1u << arrayPos;
+			ysteps++;
+		}
+		if (yoffset > rebaseRows) {
+			originRow += rebaseRows;
+			yoffset -= rebaseRows;
+			for (int k = 0; k < chunks; k++) {
+				placeChunk(k);
+			}
+			return rebaseRows;
+		}
+		return 0;
+	}
+
+	// Scrolls the terrain for the coming frame and adds the jobs that load a new chunk: its noise,
+	// then the stats of each band and the staged rows of its upload, side by side
+	void buildFrameJobs() {
+		frameJobs.clear();
+		preparedRebase = scrollTerrain();
+		if (loadingChunk < 0) {
+			return;
+		}
+		int arrayPos = loadingChunk;
+		int noise = frameJobs.add("chunk noise", [this, arrayPos] { generateChunkRows(arrayPos); });
+		for (int b = 0; b < 3; b++) {
+			frameJobs.add("band stats", [this, arrayPos, b] { updateBandStats(arrayPos, b); }, { noise });
+		}
+		frameJobs.add("stage rows", [this, arrayPos] { stageChunkRows(arrayPos); }, { noise });
+	}
+
+	// The meshes and the first chunks are built on the workers, so they are ready by the time the
+	// render thread has a context to upload them to. With overlap off they are built here first.
+	bool startStartupJobs() {
+		startupStart = startupLap = std::chrono::steady_clock::now();
+		for (int phase = 0; phase < StartupPhaseCount; phase++) {
+			startupMilliseconds[phase] = 0.0;
+		}
+		firstFrameShown = false;
+		if (!allocateTerrain()) {
+			return false;
+		}
+		resetTerrain();
+		startupJobs.clear();
+		startupMesh = startupJobs.add("terrain mesh", [this] { initTerrainMesh(); });
+		startupChunks = startupJobs.add("initial chunks", [this] { initTerrainChunks(); });
+		if (overlapFrameJobs) {
+			startupJobs.run(getJobs());
+		}
+		else {
+			startupJobs.runInline();
+		}
+		lapStartup(StartupTerrainWait);
+		return true;
+	}
+
+	// Adds the render thread's time since the last lap to phase
+	void lapStartup(StartupPhase phase) {
+		auto now = std::chrono::steady_clock::now();
+		startupMilliseconds[phase] = startupMilliseconds[phase] + std::chrono::duration<double, std::milli>(now - startupLap).count();
+		startupLap = now;
+	}
+
+	void waitForStartupJob(int task) {
+		TRACE_SCOPE("wait for terrain");
+		startupJobs.wait(task);
+		lapStartup(StartupTerrainWait);
+	}
+
+	void finishStartupJobs() {
+		waitForStartupJob(startupChunks);
+		startupJobs.wait();
+		startupMilliseconds[StartupTerrainWork] = startupJobs.getWorkMilliseconds();
+	}
+
+	void firstFrameDone() {
+		if (firstFrameShown) {
+			return;
+		}
+		firstFrameShown = true;
+		startupMilliseconds[StartupFirstFrame] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startupStart).count();
+		fprintf(stderr, "First frame after %.1f ms: context %.1f ms, buffers %.1f ms, shaders %.1f ms, waited %.1f ms for %.1f ms of terrain jobs\n",
+			startupMilliseconds[StartupFirstFrame].load(), startupMilliseconds[StartupContext].load(), startupMilliseconds[StartupBuffers].load(),
+			startupMilliseconds[StartupShaders].load(), startupMilliseconds[StartupTerrainWait].load(), startupMilliseconds[StartupTerrainWork].load());
+	}
+
+	// Call once the frame has nothing left to read of the terrain. The jobs only write what the
+	// next frame reads, and finishFrameJobs() waits for them before it does.
+	void startFrameJobs() {
+		if (!overlapFrameJobs) {
+			return;
+		}
+		JobSystem& workers = getJobs();
+		buildFrameJobs();
+		frameJobs.run(workers);
+		frameJobsRunning = true;
+	}
+
+	// Waits for the jobs that prepared this frame's terrain, or builds and runs them here when the
+	// last frame did not start them. Returns how far render space moved back along z.
+	int finishFrameJobs() {
+		if (frameJobsRunning) {
+			frameJobs.wait();
+			frameJobsRunning = false;
+		}
+		else {
+			buildFrameJobs();
+			frameJobs.runInline();
+		}
+		frameTimer.lap(FrameTimer::Prepare);
+		frameTimer.add(FrameTimer::PrepareWork, frameJobs.getWorkMilliseconds());
+		return preparedRebase;
+	}
+
+	// Heights are composited on the GPU, so only the controllers step here. Returns the latest
+	// setMountainHeight() call if there has been one since the last frame, otherwise 0.
+	uint64_t updateMountainHeights(double dt) {
+		uint64_t update = heightTargetUpdates.load();
+		uint64_t newUpdate = update != appliedHeightUpdate ? update : 0;
+		appliedHeightUpdate = update;
+		{
+			std::lock_guard<std::mutex> lock(heightsMutex);
+			heights.step(dt);
+		}
+		audioLatency.frameUpdated();
+		return newUpdate;
+	}
+
+	// What the latency measurement watches for the peak of a click
+	double getDrawnHeightLevel() {
+		return heights.getValue(BandLow) + heights.getValue(BandMid) + heights.getValue(BandHigh);
+	}
+
+	void beginSession() {
+		std::string path;
+		{
+			std::lock_guard<std::mutex> lock(sessionMutex);
+			path.swap(sessionPath);
+		}
+		if (!path.empty()) {
+			SessionHeader header;
+			header.seed = seed;
+			header.wavelength = wavelength;
+			header.octaves = octaves;
+			sessionWriter.open(path, header);
+		}
+		if (sessionReplay) {
+			replayInput = InputState();
+			replayEventPending = sessionReplay->next(replayEvent);
+			replayFrames = 0;
+			replayFinished = false;
+		}
+	}
+
+	// Applies the replayed events up to time. Returns false once the recording has ended.
+	bool applyReplayEvents(double time) {
+		while (replayEventPending && replayEvent.time <= time) {
+			if (replayEvent.type == SessionEvent::HeightTargets) {
+				for (int band = 0; band < HeightBandCount; band++) {
+					heights.setTarget(band, replayEvent.values[band]);
+				}
+			}
+			else if (replayEvent.type == SessionEvent::Brightness) {
+				shaderBrightness = replayEvent.values[0];
+			}
+			else if (replayEvent.type == SessionEvent::Input) {
+				replayInput = replayEvent.input;
+			}
+			replayEventPending = sessionReplay->next(replayEvent);
+		}
+		return replayEventPending;
+	}
+
+	void finishSession(std::chrono::steady_clock::time_point loopStart) {
+		sessionWriter.close();
+		if (sessionReplay) {
+			replaySeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - loopStart).count();
+			replayFinished = true;
+			fprintf(stderr, "Replayed %d frames in %.2f s (%.1f fps)\n", replayFrames.load(), replaySeconds.load(), replayFrames / replaySeconds);
+		}
+	}
+
+	static InputState pollInput(GLFWwindow* window, bool readCursor) {
+		InputState input;
+		for (int key = 0; key < InputKeyCount; key++) {
+			if (glfwGetKey(window, inputKeyCodes[key]) == GLFW_PRESS) {
+				input.keys |= 1u << key;
+			}
+		}
+		if (readCursor) {
+			double xpos, ypos;
+			glfwGetCursorPos(window, &xpos, &ypos);
+			glfwSetCursorPos(window, windowWidth / 2, windowHeight / 2);
+			input.cursorX = windowWidth / 2 - xpos;
+			input.cursorY = windowHeight / 2 - ypos;
+		}
+		return input;
+	}
+
+	// Stands in for PythonWrapper.py: 40 ms blocks of near silence with a 10 ms 60 Hz thump every
+	// interval seconds, analyzed and smoothed the same way, each block delivered when it would
+	// have finished recording
+	void runImpulseTest(int clicks, double interval) {
+		const int blockSize = 1764;
+		const double sampleRate = 44100.0;
+		const int clickLength = 441;
+		const double pi = 3.141592653589;
+		AudioBands bands(blockSize, sampleRate);
+		std::vector<float> block(blockSize);
+		std::default_random_engine random(seed);
+		std::uniform_real_distribution<float> noise(-1.0e-4f, 1.0e-4f);
+		int blocksPerClick = std::max(2, (int)(interval * sampleRate / blockSize + 0.5));
+		double averages[AudioBands::bandCount] = {};
+		const double keep[AudioBands::bandCount] = { 0.2, 0.7, 0.7 };
+		auto blockEnd = std::chrono::steady_clock::now();
+		for (int b = 0; b < clicks * blocksPerClick && !stopImpulses; b++) {
+			// Clicks halfway through each interval, so the heights settle before and after
+			bool click = b % blocksPerClick == blocksPerClick / 2;
+			for (int i = 0; i < blockSize; i++) {
+				block[i] = noise(random);
+			}
+			if (click) {
+				for (int i = 0; i < clickLength; i++) {
+					block[blockSize - clickLength + i] += (float)(exp(-5.0 * i / clickLength) * sin(2.0 * pi * 60.0 * i / sampleRate));
+				}
+			}
+			blockEnd += std::chrono::microseconds((long long)(1.0e6 * blockSize / sampleRate));
+			std::this_thread::sleep_until(blockEnd);
+			double captureTime = AudioLatency::now();
+
+			float values[AudioBands::bandCount];
+			bands.analyze(block.data(), values);
+			for (int k = 0; k < AudioBands::bandCount; k++) {
+				averages[k] = std::max(averages[k], 0.0) * keep[k] + values[k] * (1.0 - keep[k]);
+			}
+			setShaderBrightness(std::max((averages[1] - 4.0) / 6.0, 0.0));
+			setMountainHeight(std::max(averages[0] - 1.0, 0.0), std::max(averages[1], 0.0), std::max(averages[2], 0.0),
+				captureTime, click ? captureTime - (double)clickLength / sampleRate : -1.0);
+		}
+		AudioLatency::Summary summary = audioLatency.getSummary(AudioLatency::ClickToPeak);
+		fprintf(stderr, "Impulse test: %d clicks peaked on screen after %.1f ms (median), %.1f ms (max)\n", summary.count, summary.p50, summary.max);
+	}
+
+	double getHeight(int arrayPos, int row, int column) {
+		int index = column + row * noiseSize + arrayPos * noiseSize * noiseSize;
+		return compositeHeight(peaksArray[column], heights.getValue(BandLow), heights.getValue(BandMid), heights.getValue(BandHigh), noise1[index], noise2[index], noise3[index]);
+	}
+
+	// Packs a chunk's noise as texels of the noise ring, ready for uploadChunkRows()
+	void stageChunkRows(int arrayPos) {
+		int index = arrayPos * noiseSize * noiseSize * 4;
+		for (int row = 0; row < noiseSize; row++) {
+			for (int column = 0; column < noiseSize; column++) {
+				int noiseIndex = column + row * noiseSize + arrayPos * noiseSize * noiseSize;
+				ringUpload[index++] = noise1[noiseIndex];
+				ringUpload[index++] = noise2[noiseIndex];
+				ringUpload[index++] = noise3[noiseIndex];
+				ringUpload[index++] = peaksArray[column];
+			}
+		}
+	}
+
+	// Writes a chunk's staged rows into the noise ring. The rows may wrap past the end of the ring.
+	void uploadChunkRows(int arrayPos) {
+		const GLfloat* texels = &ringUpload[arrayPos * noiseSize * noiseSize * 4];
+		int firstRow = (int)chunkInstances[arrayPos * 2 + 1];
+		int rowsBeforeWrap = std::min(noiseSize, ringRows - firstRow);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, firstRow, noiseSize, rowsBeforeWrap, GL_RGBA, GL_FLOAT, texels);
+		renderState.countCall();
+		if (rowsBeforeWrap < noiseSize) {
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, noiseSize, noiseSize - rowsBeforeWrap, GL_RGBA, GL_FLOAT, &texels[rowsBeforeWrap * noiseSize * 4]);
+			renderState.countCall();
+		}
+	}
+
+	// Takes over the noise of a chunk the compute shader has finished. With checkComputeNoise set
+	// it is compared against the CPU path first.
+	void applyComputedNoise(int arrayPos, const std::vector<GLfloat>& texels) {
+		TRACE_SCOPE("applyComputedNoise");
+		if (checkComputeNoise) {
+			generateChunkNoise(arrayPos, chunkZOrigin[arrayPos]);
+			double maxError = 0.0;
+			for (int v = 0; v < noiseSize * noiseSize; v++) {
+				int index = v + arrayPos * noiseSize * noiseSize;
+				const float cpu[4] = { noise1[index], noise2[index], noise3[index], (float)peaksArray[v % noiseSize] };
+				for (int c = 0; c < 4; c++) {
+					maxError = std::max(maxError, (double)std::abs(texels[v * 4 + c] - cpu[c]));
+				}
+			}
+			computeNoiseError = std::max(computeNoiseError.load(), maxError);
+			computeNoiseChecked++;
+			fprintf(stderr, "Chunk noise check: chunk %d differs from the CPU by at most %g\n", arrayPos, maxError);
+		}
+		for (int v = 0; v < noiseSize * noiseSize; v++) {
+			int index = v + arrayPos * noiseSize * noiseSize;
+			noise1[index] = texels[v * 4];
+			noise2[index] = texels[v * 4 + 1];
+			noise3[index] = texels[v * 4 + 2];
+		}
+		updateChunkStats(arrayPos, chunkZOrigin[arrayPos]);
+	}
+
+	// Height = peak * (low * n1 + mid * n2 + high * n3), so interval arithmetic over the chunk's
+	// noise extremes, the controller values and the peak profile bounds every vertex
+	Aabb getChunkBounds(int arrayPos) {
+		double values[3] = { heights.getValue(BandLow), heights.getValue(BandMid), heights.getValue(BandHigh) };
+		double sumMin = 0.0;
+		double sumMax = 0.0;
+		for (int b = 0; b < 3; b++) {
+			double lo = values[b] * noiseMin[b][arrayPos];
+			double hi = values[b] * noiseMax[b][arrayPos];
+			sumMin += std::min(lo, hi);
+			sumMax += std::max(lo, hi);
+		}
+		double corners[4] = { peakMin * sumMin, peakMin * sumMax, peakMax * sumMin, peakMax * sumMax };
+		float zOrigin = (float)(chunkZOrigin[arrayPos] - originRow);
+		Aabb box;
+		box.min = glm::vec3(-noiseSize / 2, *std::min_element(corners, corners + 4), zOrigin - noiseSize / 2);
+		box.max = glm::vec3(noiseSize - 1 - noiseSize / 2, *std::max_element(corners, corners + 4), zOrigin + noiseSize - 1 - noiseSize / 2);
+		return box;
+	}
+
+	// Picks the coarsest level of each chunk whose height error, projected at the nearest point of
+	// the chunk's bounds, stays under lodErrorThreshold pixels
+	void selectLods(const glm::vec3& position, float FoV, int viewportHeight) {
+		double values[3] = { heights.getValue(BandLow), heights.getValue(BandMid), heights.getValue(BandHigh) };
+		double peakScale = std::max(std::abs(peakMin), std::abs(peakMax));
+		double pixelsPerUnit = viewportHeight / (2.0 * tan(glm::radians(FoV) / 2.0));
+		float threshold = lodErrorThreshold;
+		for (int k = 0; k < chunks; k++) {
+			Aabb box = getChunkBounds(k);
+			double distance = glm::length(glm::clamp(position, box.min, box.max) - position);
+			chunkLod[k] = 0;
+			for (int lod = ChunkLodSet::levels - 1; lod > 0; lod--) {
+				double error = 0.0;
+				for (int b = 0; b < 3; b++) {
+					error += std::abs(values[b]) * bandError[b][lod][k];
+				}
+				error *= peakScale;
+				if (threshold > 0.0f && error * pixelsPerUnit <= threshold * distance) {
+					chunkLod[k] = lod;
+					break;
 				}
 			}
 		}
+	}
+
+	// Level of the row shared with the chunk at zOrigin + offset: the coarser of the two chunks
+	int edgeLod(int arrayPos, int offset) {
+		for (int k = 0; k < chunks; k++) {
+			if (chunkZOrigin[k] == chunkZOrigin[arrayPos] + offset) {
+				return std::max(chunkLod[arrayPos], chunkLod[k]);
+			}
+		}
+		return chunkLod[arrayPos];
+	}
+
+	// Fills the draw lists with the chunks inside the view frustum, at their selected levels
+	void cullChunks(const glm::mat4& MVP) {
+		frustum.extract(MVP);
+		triangleDraws.clear();
+		lineDraws.clear();
+		int visible = 0;
+		int triangles = 0;
+		for (int k = 0; k < chunks; k++) {
+			if (frustum.intersects(getChunkBounds(k))) {
+				const ChunkLodSet::Range& range = chunkLods.getRange(chunkLod[k], edgeLod(k, -(noiseSize - 1)), edgeLod(k, noiseSize - 1));
+				triangleDraws.add(range.firstTriangleIndex, range.triangleIndexCount, k);
+				lineDraws.add(range.firstLineIndex, range.lineIndexCount, k);
+				visible++;
+				triangles += range.triangleIndexCount / 3;
+			}
+		}
+		visibleChunks = visible;
+		drawnTriangles = triangles;
+	}
+
+	void drawChunks(GLenum mode, const DrawList& list) {
+		for (const DrawList::Draw& draw : list.getDraws()) {
+			renderState.drawElementsInstancedBaseInstance(
+				mode,                                                 // mode
+				draw.count,                                           // count
+				GL_UNSIGNED_SHORT,                                    // type
+				(void*)(draw.firstIndex * sizeof(unsigned short)),    // element array buffer offset
+				draw.instanceCount,                                   // chunks
+				draw.baseInstance                                     // first chunk
+			);
+		}
+	}
+
+	static glm::mat4 computeMVP(glm::vec3 position, float horizontalAngle, float verticalAngle, float FoV) {
+		glm::vec3 direction(
+			cos(verticalAngle) * sin(horizontalAngle),
+			sin(verticalAngle),
+			cos(verticalAngle) * cos(horizontalAngle)
+		);
+		glm::vec3 right = glm::vec3(
+			sin(horizontalAngle - 3.14f / 2.0f),
+			0,
+			cos(horizontalAngle - 3.14f / 2.0f)
+		);
+		glm::vec3 up = glm::cross(right, direction);
+
+		glm::mat4 ProjectionMatrix = glm::perspective(glm::radians(FoV), 4.0f / 3.0f, 0.1f, 120.0f); // aspect ratio 4:3, draw distance 120
+		glm::mat4 ViewMatrix = glm::lookAt(
+			position,           // Camera is here
+			position + direction, // and looks here : at the same position, plus "direction"
+			up                  // Head is up (set to 0,-1,0 to look upside-down)
+		);
+		glm::mat4 ModelMatrix = glm::mat4(1.0);
+		return ProjectionMatrix * ViewMatrix * ModelMatrix;
+	}
+
+	// The CPU has no instancing, so expand every chunk to world positions
+	void expandSoftwarePositions() {
+		int index = 0;
+		for (int k = 0; k < chunks; k++) {
+			for (int v = 0; v < noiseSize * noiseSize; v++) {
+				softwarePositions[index++] = gridVertices[v * 2];
+				softwarePositions[index++] = getHeight(k, v / noiseSize, v % noiseSize);
+				softwarePositions[index++] = gridVertices[v * 2 + 1] + chunkInstances[k * 2];
+			}
+		}
+	}
+
+	void renderSoftwareFrame(const glm::mat4& MVP, int width, int height) {
+		if (!softwareRasterizer) {
+			softwareRasterizer.reset(new SoftwareRasterizer(getJobs()));
+			softwareRasterizer->setClearColor(0.05f, 0.0f, 0.15f, 0.0f);
+		}
+		expandSoftwarePositions();
+		SoftwareRasterizer::Shading shading = { (float)shaderBrightness, (float)shaderR, (float)shaderG, (float)shaderB };
+		softwareRasterizer->resize(width, height);
+		softwareRasterizer->render(softwarePositions.data(), noiseSize * noiseSize * chunks, indices.data(), (int)indices.size(), MVP, shading);
+	}
+
+	// If benchmarkVertexCache() was called, renders the current terrain on the CPU through a
+	// 16 entry FIFO vertex cache in row order and in the reordered order. The resolution is kept
+	// small so the vertex stage is a large part of the frame.
+	void runRequestedVertexCacheBenchmark(const glm::mat4& MVP) {
+		int frames = vertexCacheBenchmarkFrames.exchange(0);
+		if (frames <= 0) {
+			return;
+		}
+		SoftwareRasterizer rasterizer(getJobs());
+		rasterizer.resize(320, 180);
+		rasterizer.setVertexCacheSize(16);
+		SoftwareRasterizer::Shading shading = { (float)shaderBrightness, (float)shaderR, (float)shaderG, (float)shaderB };
+		expandSoftwarePositions();
+		const ArenaArray<unsigned short>* orders[2] = { &rowOrderIndices, &indices };
+		for (int order = 0; order < 2; order++) {
+			const ArenaArray<unsigned short>& list = *orders[order];
+			auto startTime = std::chrono::steady_clock::now();
+			for (int f = 0; f < frames; f++) {
+				rasterizer.render(softwarePositions.data(), noiseSize * noiseSize * chunks, list.data(), (int)list.size(), MVP, shading);
+			}
+			vertexCacheResults[order] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count() / frames;
+			vertexCacheResults[2 + order] = rasterizer.getVertexTransformsLastFrame() / (list.size() / 3.0);
+		}
+		fprintf(stderr, "Vertex cache benchmark: row order %.3f ms (ACMR %.3f), reordered %.3f ms (ACMR %.3f)\n",
+			vertexCacheResults[0].load(), vertexCacheResults[2].load(), vertexCacheResults[1].load(), vertexCacheResults[3].load());
+	}
+
+	// Renders the current frame on the CPU and writes it out if saveReferenceImage() was called
+	void writeRequestedReferenceImage(const glm::mat4& MVP, int width, int height, bool frameRendered) {
+		std::string path;
+		{
+			std::lock_guard<std::mutex> lock(referenceImageMutex);
+			path.swap(referenceImagePath);
+		}
+		if (path.empty()) {
+			return;
+		}
+		if (!frameRendered) {
+			renderSoftwareFrame(MVP, width, height);
+		}
+		if (softwareRasterizer->writeImage(path)) {
+			fprintf(stderr, "Saved reference image to %s\n", path.c_str());
+		}
+	}
+
+	// Fallback when no GL context can be created: simulate at 60 Hz and render on the CPU
+	void runSoftware() {
+		fprintf(stderr, "Falling back to the software renderer\n");
+		TRACE_THREAD_NAME("software render");
+		lapStartup(StartupContext); // the attempt at a GL context
+		finishStartupJobs();
+		const int width = (int)windowWidth;
+		const int height = (int)windowHeight;
+		auto nextFrame = std::chrono::steady_clock::now();
+		auto loopStart = nextFrame;
+		beginSession();
+		while (!stopProgram) {
+			if (sessionReplay && !applyReplayEvents(replayFrames++ * replayTimestep)) {
+				break;
+			}
+			frameTimer.beginFrame(false);
+			TRACE_BEGIN("frame");
+			TRACE_BEGIN("prepare");
+			finishFrameJobs();
+			TRACE_END("prepare");
+			TRACE_BEGIN("update");
+			uint64_t heightUpdate = updateMountainHeights(replayTimestep);
+			frameTimer.lap(FrameTimer::Update);
+			TRACE_END("update");
+
+			TRACE_BEGIN("render");
+			glm::mat4 MVP = computeMVP(vec3(0, 2.0, yoffset), 0.0f, 0.0f, 100.0f);
+			renderSoftwareFrame(MVP, width, height);
+			if (heightUpdate) {
+				TRACE_FLOW_END("audio block", heightUpdate);
+			}
+			frameTimer.lap(FrameTimer::Submit);
+			TRACE_END("render");
+			TRACE_BEGIN("capture");
+			writeRequestedReferenceImage(MVP, width, height, true);
+			runRequestedVertexCacheBenchmark(MVP);
+			frameCapture.submitPixels(softwareRasterizer->getPixels().data(), width, height);
+			audioLatency.frameSwapped(getDrawnHeightLevel());
+			firstFrameDone();
+			frameTimer.lap(FrameTimer::Capture);
+			TRACE_END("capture");
+			startFrameJobs();
+			frameTimer.lap(FrameTimer::Prepare);
+
+			TRACE_BEGIN("wait");
+			nextFrame += std::chrono::microseconds(16667);
+			if (!sessionReplay || replayRealtime) {
+				std::this_thread::sleep_until(nextFrame);
+			}
+			frameTimer.lap(FrameTimer::Wait);
+			TRACE_END("wait");
+			TRACE_END("frame");
+			frameTimer.endFrame();
+		}
+		frameJobs.wait();
+		frameJobsRunning = false;
+		finishSession(loopStart);
+		frameCapture.shutdown();
+		stopTrace();
+	}
+
+public:
+
+	void run() {
+		TRACE_THREAD_NAME("render");
+		#pragma region Noise
+		fprintf(stderr, "Random seed is %d\n", seed);
+		if (!startStartupJobs()) {
+			return;
+		}
 		#pragma endregion
 
 		#pragma region Init
@@ -219,6 +1260,7 @@ public:
 		if (!glfwInit())
 		{
 			fprintf(stderr, "Failed to initialize GLFW\n");
+			runSoftware();
 			return;
 		}
 
@@ -233,65 +1275,82 @@ public:
 		if (window == NULL) {
 			fprintf(stderr, "Failed to open GLFW window. If you have an Intel GPU, they are not 3.3 compatible.\n");
 			glfwTerminate();
+			runSoftware();
 			return;
 		}
 		glfwMakeContextCurrent(window); // Initialize GLEW
 		glewExperimental = true; // Needed in core profile
 		if (glewInit() != GLEW_OK) {
 			fprintf(stderr, "Failed to initialize GLEW\n");
+			glfwTerminate();
+			runSoftware();
 			return;
 		}
+		renderState.init();
+		lapStartup(StartupContext);
 		#pragma endregion
 
 		#pragma region Vertices
+		waitForStartupJob(startupMesh);
+		// The vertex array object records the attribute layout and index buffer once
 		GLuint VertexArrayID;
 		glGenVertexArrays(1, &VertexArrayID);
-		glBindVertexArray(VertexArrayID);
-
-		// Vertices
-		int index = 0;
-		for (int k = 0; k < chunks; k++) {
-			int koffset = k * (noiseSize - 1);
-			for (int j = 0; j < noiseSize; j++) {
-				for (int i = 0; i < noiseSize; i++) {
-					g_vertex_buffer_data[index] = i - noiseSize / 2;
-					index++;
-					g_vertex_buffer_data[index] = 0;
-					index++;
-					g_vertex_buffer_data[index] = j - noiseSize / 2 + koffset;
-					index++;
-				}
-			}
-		}
+		renderState.bindVertexArray(VertexArrayID);
 
 		GLuint vertexbuffer;
 		glGenBuffers(1, &vertexbuffer);
-		glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
-		glBufferStorage(GL_ARRAY_BUFFER, noiseSize * noiseSize * 3 * chunks * sizeof(GLfloat), g_vertex_buffer_data, GL_DYNAMIC_STORAGE_BIT);
-
-		// Vertex indices
-		std::vector<unsigned short> indices;
-		for (int k = 0; k < chunks; k++) {
-			int koffset = noiseSize * noiseSize * k;
-			for (int j = 0; j < noiseSize - 1; j++) {
-				int joffset = noiseSize * j;
-				for (int i = 0; i < noiseSize - 1; i++) {
-					index = i + joffset + koffset;
-					indices.push_back(index);
-					indices.push_back(index + 1);
-					indices.push_back(index + noiseSize);
-					indices.push_back(index + 1);
-					indices.push_back(index + noiseSize);
-					indices.push_back(index + noiseSize + 1);
-				}
-			}
+		renderState.bindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
+		glBufferData(GL_ARRAY_BUFFER, gridVertices.size() * sizeof(GLfloat), gridVertices.data(), GL_STATIC_DRAW);
+
+		// 1st attribute buffer : grid vertices, shared by every chunk
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(
+			0,                  // attribute 0. No particular reason for 0, but must match the layout in the shader.
+			2,                  // size
+			GL_FLOAT,			// type
+			GL_FALSE,           // normalized?
+			0,                  // stride
+			(void*)0            // array buffer offset
+		);
+
+		// 2nd attribute buffer : chunk instances
+		GLuint instancebuffer;
+		glGenBuffers(1, &instancebuffer);
+		renderState.bindBuffer(GL_ARRAY_BUFFER, instancebuffer);
+		if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) {
+			glBufferStorage(GL_ARRAY_BUFFER, sizeof(chunkInstances), chunkInstances, GL_DYNAMIC_STORAGE_BIT);
 		}
-
-		// Generate a buffer for the indices
+		else {
+			glBufferData(GL_ARRAY_BUFFER, sizeof(chunkInstances), chunkInstances, GL_DYNAMIC_DRAW);
+		}
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+		glVertexAttribDivisor(1, 1);
+		renderState.setInstanceAttribute(VertexArrayID, instancebuffer, 1, 2);
+
+		// Noise ring, filled one chunk at a time as chunks are loaded
+		GLuint noiseRingTexture;
+		glGenTextures(1, &noiseRingTexture);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, noiseRingTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, noiseSize, ringRows, 0, GL_RGBA, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+		// Generate a buffer for the indices of every chunk level of detail
 		GLuint elementbuffer;
 		glGenBuffers(1, &elementbuffer);
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementbuffer);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned short), &indices[0], GL_STATIC_DRAW);
+		const std::vector<unsigned short>& lodIndices = chunkLods.getIndices();
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, lodIndices.size() * sizeof(unsigned short), &lodIndices[0], GL_STATIC_DRAW);
+		const ChunkLodSet::Range& fullDensity = chunkLods.getRange(0, 0, 0);
+		printf("Wireframe: %d triangle edges, %d unique line segments per chunk\n", (int)fullDensity.triangleIndexCount, (int)fullDensity.lineIndexCount / 2);
+		printf("Vertex cache: ACMR %.3f in row order, %.3f reordered\n", chunkLods.getAcmrBefore(), chunkLods.getAcmrAfter());
+		triangleDraws.reserve(chunks);
+		lineDraws.reserve(chunks);
+		lapStartup(StartupBuffers);
 		#pragma endregion
 
 		#pragma region Settings
@@ -310,15 +1369,54 @@ public:
 		glLineWidth(2.0);
 		glClearColor(0.05f, 0.0f, 0.15f, 0.0f);
 		//glClearColor(0.35f, 0.4f, 0.9f, 0.0f); // windowx xp land background
-		glEnable(GL_DEPTH_TEST);
+		renderState.setEnabled(GL_DEPTH_TEST, true);
 		glDepthFunc(GL_LESS);
-		glEnable(GL_BLEND);
+		renderState.setEnabled(GL_BLEND, true);
 		// glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // normal blending
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE); // additive blending
 		//glEnable(GL_CULL_FACE);
 
+		renderState.polygonOffset(-1, -1);
+
 		// Init shaders
-		GLuint programID = LoadShaders();
+		ShaderProgram shader;
+		ShaderProgram wireframeShader;
+		if (!shader.init(LoadShaders()) || !wireframeShader.init(LoadWireframeShaders())) {
+			finishStartupJobs();
+			glfwTerminate();
+			return;
+		}
+
+		// Programs for drawing from displaced vertices captured once per frame
+		ShaderProgram displaceFeedbackShader;
+		ShaderProgram cachedShader;
+		ShaderProgram cachedWireframeShader;
+		if (!displaceFeedbackShader.init(LoadDisplaceFeedbackShader()) || !cachedShader.init(LoadCachedShaders()) || !cachedWireframeShader.init(LoadCachedWireframeShaders())) {
+			finishStartupJobs();
+			glfwTerminate();
+			return;
+		}
+		for (ShaderProgram* program : { &cachedShader, &cachedWireframeShader }) {
+			program->use(renderState);
+			glUniform1i(glGetUniformLocation(program->getProgramID(), "displacedVertices"), DisplacedVertexCache::textureUnit);
+		}
+		DisplacedVertexCache displacedVertices;
+		displacedVertices.init(renderState, noiseSize * noiseSize, chunks, elementbuffer);
+		FrameUniformBuffer frameUniforms;
+		frameUniforms.init(/*passes*/ 3);
+
+		// Chunk noise on the GPU where compute shaders are available, otherwise on the CPU
+		if (allowComputeNoise && ChunkNoiseCompute::isSupported()) {
+			float peaks[noiseSize];
+			for (int i = 0; i < noiseSize; i++) {
+				peaks[i] = (float)peaksArray[i];
+			}
+			computeNoise = noiseCompute.init(renderState, LoadChunkNoiseComputeShader(), seed, peaks, noiseSize, chunks);
+		}
+		printf("Chunk noise: %s\n", computeNoise ? "compute shader" : "CPU");
+		printf("Chunk draws: %s\n", renderState.hasBaseInstance() ? "base instance" : "instance attribute offsets");
+		lapStartup(StartupShaders);
+		finishStartupJobs();
 		#pragma endregion
 
 		#pragma region Loop
@@ -327,90 +1425,91 @@ public:
 
 		//double lastTime = 0;
 		double currentTime = 0;
+		auto loopStart = std::chrono::steady_clock::now();
+		beginSession();
+		bool replayEnded = false;
 		do {
 			// Time
+			frameTimer.beginFrame(true);
+			TRACE_BEGIN("frame");
+			TRACE_BEGIN("wait");
 			float deltaTime = glfwGetTime();
-			int sleepTime = std::max(16.666 - deltaTime*1000.0, 0.0);
-			std::this_thread::sleep_for(std::chrono::milliseconds(sleepTime));
-			deltaTime = glfwGetTime();
-			currentTime += deltaTime;
-			glfwSetTime(0);
-
-			// Update position
-			yoffset += yscrollspeed;
-			if (yoffset > (ysteps + 1) * (noiseSize - 1)) {
-				// Load a new chunk (update z coordinates and noise)
-				int arrayPos = ysteps % chunks;
-				int zOrigin = (ysteps + chunks) * (noiseSize - 1);
-				index = 2 + arrayPos * noiseSize * noiseSize * 3;
-				for (int j = 0; j < noiseSize; j++) {
-					for (int i = 0; i < noiseSize; i++) {
-						g_vertex_buffer_data[index] = j - noiseSize / 2 + zOrigin;
-						index += 3;
-					}
-				}
-				for (int i = 0; i < noiseSize; i++) {
-					for (int j = 0; j < noiseSize; j++) {
-						index = j + i * noiseSize + arrayPos * noiseSize * noiseSize;
-						noise1[index] = max(perlin.octaveNoise0_1((i + zOrigin) / wavelength, j / wavelength, 1) * 10 - 4, 0.0) * 1.5;
-						noise2[index] = perlin.octaveNoise0_1((i + zOrigin) / (wavelength / 2), j / (wavelength / 2), 1) * 5.0 - 3.0;
-						noise3[index] = perlin.octaveNoise0_1((i + zOrigin) / (wavelength / 4), j / (wavelength / 4), 1) * 4.0 - 1.0;
-					}
-				}
-				ysteps++;
+			if (!sessionReplay || replayRealtime) {
+				int sleepTime = std::max(16.666 - deltaTime*1000.0, 0.0);
+				std::this_thread::sleep_for(std::chrono::milliseconds(sleepTime));
+			}
+			deltaTime = glfwGetTime();
+			if (sessionReplay) {
+				// A fixed timestep, so the replay does not depend on how fast frames are drawn
+				deltaTime = replayTimestep;
+				replayEnded = !applyReplayEvents(replayFrames++ * replayTimestep);
 			}
+			currentTime += deltaTime;
+			glfwSetTime(0);
+			renderState.beginFrame();
+			frameTimer.lap(FrameTimer::Wait);
+			TRACE_END("wait");
+
+			// Terrain for this frame, prepared while the last one was drawn
+			TRACE_BEGIN("prepare");
+			position.z -= finishFrameJobs();
+			TRACE_END("prepare");
+
+			TRACE_BEGIN("update");
 
 			// Update mountain heights
-			int ind = 1;
-			mLow.step();
-			mMid.step();
-			mHi.step();
-			for (int k = 0; k < chunks; k++) {
-				int koffset = k * noiseSize * noiseSize;
-				for (int j = 0; j < noiseSize; j++) {
-					int joffset = j * noiseSize;
-					for (int i = 0; i < noiseSize; i++) {
-						double iscale = peaksArray[i]; // abs(i - noiseSize / 2.0) / (noiseSize / 2.0) + 0.05;
-						g_vertex_buffer_data[ind] = iscale * (
-							mLow.getValue() * noise1.at(i + joffset + koffset) +
-							mMid.getValue() * noise2.at(i + joffset + koffset) +
-							mHi.getValue() * noise3.at(i + joffset + koffset));
-						ind += 3;
+			uint64_t heightUpdate = updateMountainHeights(sessionReplay ? replayTimestep : deltaTime);
+			frameTimer.lap(FrameTimer::Update);
+			TRACE_END("update");
+
+			// Upload recycled and rebased chunks
+			TRACE_BEGIN("upload");
+			frameTimer.beginGpu(FrameTimer::GpuUpload);
+			for (int k = 0; k < chunks && (dirtyChunks | dirtyInstances) != 0; k++) {
+				if (dirtyInstances & (1u << k)) {
+					renderState.bindBuffer(GL_ARRAY_BUFFER, instancebuffer);
+					glBufferSubData(GL_ARRAY_BUFFER, k * 2 * sizeof(GLfloat), 2 * sizeof(GLfloat), &chunkInstances[k * 2]);
+					renderState.countCall();
+					dirtyInstances &= ~(1u << k);
+				}
+				if (dirtyChunks & (1u << k)) {
+					if (computeNoise) {
+						noiseCompute.generate(renderState, k, getNoiseRow(chunkZOrigin[k]), wavelength, (int)chunkInstances[k * 2 + 1], noiseRingTexture);
+					}
+					else {
+						uploadChunkRows(k);
 					}
+					dirtyChunks &= ~(1u << k);
 				}
 			}
-			glBufferSubData(GL_ARRAY_BUFFER, 0, noiseSize * noiseSize * 3 * chunks * sizeof(GLfloat), g_vertex_buffer_data);
-			
+			int generated;
+			while (computeNoise && (generated = noiseCompute.collect(computeTexels)) >= 0) {
+				applyComputedNoise(generated, computeTexels);
+			}
+			frameTimer.endGpu();
+			frameTimer.lap(FrameTimer::Upload);
+			TRACE_END("upload");
+			TRACE_BEGIN("scene");
+
 			// Clear the screen.
 			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			renderState.countCall();
 
-			// 1st attribute buffer : vertices
-			glEnableVertexAttribArray(0);
-			glBindBuffer(GL_ARRAY_BUFFER, vertexbuffer);
-			glVertexAttribPointer(
-				0,                  // attribute 0. No particular reason for 0, but must match the layout in the shader.
-				3,                  // size
-				GL_FLOAT,			// type
-				GL_FALSE,           // normalized?
-				0,                  // stride
-				(void*)0            // array buffer offset
-			);
-
+			// Input, from the window or the session being replayed
+			InputState input = sessionReplay ? replayInput : pollInput(window, mouseControlsOn);
+			sessionWriter.recordInput(input);
 
 			// Camera
 			if (mouseControlsOn) {
-				double xpos, ypos;
-				glfwGetCursorPos(window, &xpos, &ypos);
-				glfwSetCursorPos(window, windowWidth / 2, windowHeight / 2);
-				horizontalAngle += mouseSpeed * deltaTime * float(windowWidth / 2 - xpos);
-				verticalAngle += mouseSpeed * deltaTime * float(windowHeight / 2 - ypos);
-				if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS) {
+				horizontalAngle += mouseSpeed * deltaTime * float(input.cursorX);
+				verticalAngle += mouseSpeed * deltaTime * float(input.cursorY);
+				if (input.isDown(KeyQ)) {
 					mouseControlsOn = false;
 					rotatingCamera = true;
 				}
 			}
 			else {
-				if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS) {
+				if (input.isDown(KeyE)) {
 					mouseControlsOn = true;
 					rotatingCamera = false;
 				}
@@ -436,115 +1535,168 @@ public:
 				0,
 				cos(horizontalAngle - 3.14f / 2.0f)
 			);
-			glm::vec3 up = glm::cross(right, direction);
 
 			// Move forward
-			if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
+			if (input.isDown(KeyW)) {
 				position += direction * deltaTime * speed;
 			}
 			// Move backward
-			if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) {
+			if (input.isDown(KeyS)) {
 				position -= direction * deltaTime * speed;
 			}
 			// Strafe right
-			if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) {
+			if (input.isDown(KeyD)) {
 				position += right * deltaTime * speed;
 			}
 			// Strafe left
-			if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) {
+			if (input.isDown(KeyA)) {
 				position -= right * deltaTime * speed;
 			}
 			// Move up
-			if (glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS) {
+			if (input.isDown(KeySpace)) {
 				position.y += deltaTime * speed;
 			}
 			// Move down
-			if (glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS) {
+			if (input.isDown(KeyLeftShift)) {
 				position.y -= deltaTime * speed;
 			}
 			// FoV up
-			if (glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS) {
+			if (input.isDown(KeyR)) {
 				FoV += deltaTime * fovspeed;
 			}
 			// FoV down
-			if (glfwGetKey(window, GLFW_KEY_F) == GLFW_PRESS) {
+			if (input.isDown(KeyF)) {
 				FoV -= deltaTime * fovspeed;
 			}
 			FoV = clamp<float>(FoV, 45, 120);
 
 			// Shader Controls
-			if (glfwGetKey(window, GLFW_KEY_U) == GLFW_PRESS) shaderR += 0.01;
-			if (glfwGetKey(window, GLFW_KEY_J) == GLFW_PRESS) shaderR -= 0.01;
-			if (glfwGetKey(window, GLFW_KEY_I) == GLFW_PRESS) shaderG += 0.01;
-			if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS) shaderG -= 0.01;
-			if (glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS) shaderB += 0.01;
-			if (glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS) shaderB -= 0.01;
+			if (input.isDown(KeyU)) shaderR += 0.01;
+			if (input.isDown(KeyJ)) shaderR -= 0.01;
+			if (input.isDown(KeyI)) shaderG += 0.01;
+			if (input.isDown(KeyK)) shaderG -= 0.01;
+			if (input.isDown(KeyO)) shaderB += 0.01;
+			if (input.isDown(KeyL)) shaderB -= 0.01;
 			shaderR = clamp<float>(shaderR, 0.0, 1.0);
 			shaderG = clamp<float>(shaderG, 0.0, 1.0);
 			shaderB = clamp<float>(shaderB, 0.0, 1.0);
 
-			glm::mat4 ProjectionMatrix = glm::perspective(glm::radians(FoV), 4.0f / 3.0f, 0.1f, 120.0f); // aspect ratio 4:3, draw distance 120
-			glm::mat4 ViewMatrix = glm::lookAt(
-				position,           // Camera is here
-				position + direction, // and looks here : at the same position, plus "direction"
-				up                  // Head is up (set to 0,-1,0 to look upside-down)
-			);
-			glm::mat4 ModelMatrix = glm::mat4(1.0);
-			glm::mat4 MVP = ProjectionMatrix * ViewMatrix * ModelMatrix;
-
-			GLuint MatrixID = glGetUniformLocation(programID, "MVP");
-			glUniformMatrix4fv(MatrixID, 1, GL_FALSE, &MVP[0][0]);
+			glm::mat4 MVP = computeMVP(position, horizontalAngle, verticalAngle, FoV);
 
 			// Use shader
-			GLuint DrawColID = glGetUniformLocation(programID, "drawCol");
-			GLuint rColID = glGetUniformLocation(programID, "rAmt");
-			GLuint gColID = glGetUniformLocation(programID, "gAmt");
-			GLuint bColID = glGetUniformLocation(programID, "bAmt");
-			glUniform1f(DrawColID, shaderBrightness);
-			glUniform1f(rColID, shaderR);
-			glUniform1f(gColID, shaderG);
-			glUniform1f(bColID, shaderB);
-			glUseProgram(programID);
-
-			// Index buffer
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementbuffer);
-
-			// Draw triangles
-			glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-			glDrawElements(
-				GL_TRIANGLES,      // mode
-				indices.size(),    // count
-				GL_UNSIGNED_SHORT,   // type
-				(void*)0           // element array buffer offset
-			);
-
-			// Draw triangles again
-			glUniform1f(DrawColID, shaderBrightness + 0.4);
-			glUniform1f(rColID, shaderR);
-			glUniform1f(gColID, shaderG);
-			glUniform1f(bColID, shaderB);
-			glPolygonOffset(-1, -1);
-			glEnable(GL_POLYGON_OFFSET_LINE);
-			glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-			glDrawElements(
-				GL_TRIANGLES,      // mode
-				indices.size(),    // count
-				GL_UNSIGNED_SHORT,   // type
-				(void*)0           // element array buffer offset
-			);
-			glDisable(GL_POLYGON_OFFSET_LINE);
+			int framebufferWidth, framebufferHeight;
+			glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+			glm::vec3 shaderColor = glm::vec3(shaderR, shaderG, shaderB);
+			glm::vec2 viewportSize = glm::vec2(framebufferWidth, framebufferHeight);
+			glm::vec3 bandAmplitudes = glm::vec3(heights.getValue(BandLow), heights.getValue(BandMid), heights.getValue(BandHigh));
+			frameUniforms.setPass(0, MVP, shaderColor, shaderBrightness, shaderBrightness + 0.4, viewportSize, bandAmplitudes);
+			frameUniforms.setPass(1, MVP, shaderColor, shaderBrightness + 0.4, shaderBrightness + 0.4, viewportSize, bandAmplitudes);
+			frameUniforms.setPass(2, MVP, shaderColor, shaderBrightness + 0.4, shaderBrightness + 0.4, viewportSize, bandAmplitudes, lineDepthBias);
+			frameUniforms.upload(renderState);
+			frameUniforms.bindPass(renderState, 0);
+			renderState.bindVertexArray(VertexArrayID);
+			selectLods(position, FoV, framebufferHeight);
+			cullChunks(MVP);
+			int mode = wireframeBenchmark.beginFrame(wireframeMode);
+			if (wireframeBenchmark.isRunning()) {
+				frameTimer.suspendGpu(); // its query times every pass at once
+			}
+			frameTimer.lap(FrameTimer::Scene);
+			TRACE_END("scene");
+			TRACE_BEGIN("draw");
+
+			// With cached vertices the heights are composited once, then every pass draws from them
+			ShaderProgram* terrainShader = &shader;
+			ShaderProgram* terrainWireframeShader = &wireframeShader;
+			if (cacheDisplacedVertices) {
+				displaceFeedbackShader.use(renderState);
+				frameTimer.beginGpu(FrameTimer::GpuDisplace);
+				displacedVertices.capture(renderState, VertexArrayID);
+				frameTimer.endGpu();
+				renderState.bindVertexArray(displacedVertices.getVertexArray());
+				terrainShader = &cachedShader;
+				terrainWireframeShader = &cachedWireframeShader;
+			}
 
-			glDisableVertexAttribArray(0);
+			if (mode == WireframeSinglePass) {
+				// Draw filled triangles and their edges at once
+				terrainWireframeShader->use(renderState);
+				renderState.polygonMode(GL_FILL);
+				renderState.setEnabled(GL_POLYGON_OFFSET_LINE, false);
+				frameTimer.beginGpu(FrameTimer::GpuFill);
+				drawChunks(GL_TRIANGLES, triangleDraws);
+				frameTimer.endGpu();
+			}
+			else if (mode == WireframeEdgeLines) {
+				// Draw triangles
+				terrainShader->use(renderState);
+				renderState.polygonMode(GL_FILL);
+				renderState.setEnabled(GL_POLYGON_OFFSET_LINE, false);
+				frameTimer.beginGpu(FrameTimer::GpuFill);
+				drawChunks(GL_TRIANGLES, triangleDraws);
+				frameTimer.endGpu();
+
+				// Draw each edge once
+				frameUniforms.bindPass(renderState, 2);
+				frameTimer.beginGpu(FrameTimer::GpuWireframe);
+				drawChunks(GL_LINES, lineDraws);
+				frameTimer.endGpu();
+			}
+			else {
+				// Draw triangles
+				terrainShader->use(renderState);
+				renderState.polygonMode(GL_FILL);
+				renderState.setEnabled(GL_POLYGON_OFFSET_LINE, false); // some drivers offset filled polygons too
+				frameTimer.beginGpu(FrameTimer::GpuFill);
+				drawChunks(GL_TRIANGLES, triangleDraws);
+				frameTimer.endGpu();
+
+				// Draw triangles again
+				frameUniforms.bindPass(renderState, 1);
+				renderState.setEnabled(GL_POLYGON_OFFSET_LINE, true);
+				renderState.polygonMode(GL_LINE);
+				frameTimer.beginGpu(FrameTimer::GpuWireframe);
+				drawChunks(GL_TRIANGLES, triangleDraws);
+				frameTimer.endGpu();
+			}
+			wireframeBenchmark.endFrame();
+			frameTimer.lap(FrameTimer::Submit);
+			TRACE_END("draw");
+
+			// Recording
+			TRACE_BEGIN("capture");
+			frameCapture.captureFrame(framebufferWidth, framebufferHeight);
+			writeRequestedReferenceImage(MVP, framebufferWidth, framebufferHeight, false);
+			runRequestedVertexCacheBenchmark(MVP);
+			frameTimer.lap(FrameTimer::Capture);
+			TRACE_END("capture");
+			startFrameJobs();
+			frameTimer.lap(FrameTimer::Prepare);
 
 			// Swap buffers
+			TRACE_BEGIN("swap");
 			glfwSwapBuffers(window);
+			audioLatency.frameSwapped(getDrawnHeightLevel());
+			firstFrameDone();
+			if (heightUpdate) {
+				TRACE_FLOW_END("audio block", heightUpdate);
+			}
 			glfwPollEvents();
+			frameTimer.lap(FrameTimer::Swap);
+			TRACE_END("swap");
+			TRACE_END("frame");
+			frameTimer.endFrame();
 
 		} // Check if the ESC key was pressed or the window was closed
 		while (glfwGetKey(window, GLFW_KEY_ESCAPE) != GLFW_PRESS &&
-			glfwWindowShouldClose(window) == 0 && !stopProgram);
+			glfwWindowShouldClose(window) == 0 && !stopProgram && !replayEnded);
 		#pragma endregion
 
+		frameJobs.wait();
+		frameJobsRunning = false;
+		finishSession(loopStart);
+		frameCapture.shutdown();
+		stopTrace();
 		glfwTerminate();
 		return;
 	}
@@ -560,42 +1712,500 @@ public:
 	}
 
 	void stopThreadGracefully() {
+		stopImpulseTest();
 		stopProgram = true;
 		if (glThread.joinable()) {
 			glThread.join();
 		}
 	}
 
+	// Ignored while a session is replayed, which sets the brightness itself
 	void setShaderBrightness(double value) {
+		if (sessionReplay) {
+			return;
+		}
 		shaderBrightness = value;
+		sessionWriter.recordBrightness(value);
+	}
+
+	// captureTime is when the audio block finished recording, from AudioLatency::now(), or
+	// negative if unknown. clickTime marks a test click.
+	void setMountainHeight(double low, double mid, double high, double captureTime = -1.0, double clickTime = -1.0) {
+		if (sessionReplay) {
+			return;
+		}
+		sessionWriter.recordHeights(low, mid, high);
+		heights.setTarget(BandLow, low);
+		heights.setTarget(BandMid, mid);
+		heights.setTarget(BandHigh, high);
+		audioLatency.blockArrived(captureTime, clickTime);
+		// Counted outside the macro, which expands to nothing without VISUALIZER_TRACE
+		uint64_t update = ++heightTargetUpdates;
+		TRACE_FLOW_START("audio block", update);
+	}
+
+	AudioLatency::Summary getAudioLatency(int stage) {
+		return audioLatency.getSummary(stage);
+	}
+
+	void resetAudioLatency() {
+		audioLatency.reset();
+	}
+
+	// Gains are per 1/60 s step, as heightPIDController has them
+	bool setHeightGains(int band, double p, double i, double d, double integralDecay) {
+		if (band < 0 || band >= HeightBandCount) {
+			fprintf(stderr, "No height band %d\n", band);
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(heightsMutex);
+		heights.setGains(band, p, i, d, integralDecay);
+		return true;
+	}
+
+	bool setHeightSpring(int band, bool enabled, double frequency) {
+		if (band < 0 || band >= HeightBandCount) {
+			fprintf(stderr, "No height band %d\n", band);
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(heightsMutex);
+		heights.setSpring(band, enabled, frequency);
+		return true;
+	}
+
+	// Replaces the audio input until it finishes or stopImpulseTest() is called
+	void startImpulseTest(int clicks, double interval) {
+		stopImpulseTest();
+		stopImpulses = false;
+		impulseThread = std::thread(&OpenGLProgram::runImpulseTest, this, clicks, interval);
+	}
+
+	// Records every parameter update from when the program starts; call before startOpenGLThread()
+	bool recordSession(const std::string& path) {
+		if (glThread.joinable()) {
+			fprintf(stderr, "Session recording has to start before the program, so a replay starts from the same terrain\n");
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(sessionMutex);
+		sessionPath = path;
+		return true;
+	}
+
+	void stopSessionRecording() {
+		sessionWriter.close();
+	}
+
+	// Takes the terrain parameters from the recording; call instead of defineParams(). With
+	// realtime false, frames are drawn as fast as possible.
+	bool loadReplay(const std::string& path, bool realtime) {
+		std::unique_ptr<SessionReader> reader(new SessionReader());
+		if (glThread.joinable() || !reader->open(path)) {
+			return false;
+		}
+		const SessionHeader& header = reader->getHeader();
+		defineParams(header.seed, header.wavelength, header.octaves);
+		sessionReplay = std::move(reader);
+		replayRealtime = realtime;
+		return true;
+	}
+
+	std::tuple<int, double, bool> getReplayStats() {
+		return std::make_tuple(replayFrames.load(), replaySeconds.load(), replayFinished.load());
+	}
+
+	void stopImpulseTest() {
+		stopImpulses = true;
+		if (impulseThread.joinable()) {
+			impulseThread.join();
+		}
+	}
+
+	void startRecording(const std::string& target, int fps) {
+		frameCapture.requestStart(target, fps);
+	}
+
+	void stopRecording() {
+		frameCapture.requestStop();
+	}
+
+	VideoSink::Stats getRecordingStats() {
+		return frameCapture.getStats();
+	}
+
+	int getApiCallsPerFrame() {
+		return renderState.getCallsLastFrame();
 	}
 
-	void setMountainHeight(double low, double mid, double high) {
-		mLow.setTarget(low);
-		mMid.setTarget(mid);
-		mHi.setTarget(high);
+	void saveReferenceImage(const std::string& path) {
+		std::lock_guard<std::mutex> lock(referenceImageMutex);
+		referenceImagePath = path;
+	}
+
+	int getVisibleChunks() {
+		return visibleChunks;
+	}
+
+	int getDrawnTriangles() {
+		return drawnTriangles;
+	}
+
+	void setLodErrorThreshold(float pixels) {
+		lodErrorThreshold = pixels;
+	}
+
+	void benchmarkVertexCache(int frames) {
+		vertexCacheBenchmarkFrames = frames;
+	}
+
+	void setCacheDisplacedVertices(bool enabled) {
+		cacheDisplacedVertices = enabled;
+	}
+
+	// Takes effect when the window is created
+	void setComputeNoise(bool enabled) {
+		allowComputeNoise = enabled;
+	}
+
+	bool isComputeNoiseActive() {
+		return computeNoise;
+	}
+
+	void checkComputeNoiseAgainstCpu(bool enabled) {
+		checkComputeNoise = enabled;
+	}
+
+	std::tuple<int, double> getComputeNoiseCheckResults() {
+		return std::make_tuple(computeNoiseChecked.load(), computeNoiseError.load());
+	}
+
+	std::tuple<double, double, double, double> getVertexCacheBenchmarkResults() {
+		return std::make_tuple(vertexCacheResults[0].load(), vertexCacheResults[1].load(), vertexCacheResults[2].load(), vertexCacheResults[3].load());
+	}
+
+	void setFrameTiming(bool enabled) {
+		frameTimer.setEnabled(enabled);
+	}
+
+	// count workers, or -1 for one per core but one. Call before the program starts.
+	bool setWorkerThreads(int count, bool pin) {
+		std::lock_guard<std::mutex> lock(jobsMutex);
+		if (jobs) {
+			fprintf(stderr, "The worker threads have already started\n");
+			return false;
+		}
+		workerThreads = std::min(count, JobSystem::maxThreads - 1);
+		pinWorkerThreads = pin;
+		return true;
+	}
+
+	int getWorkerThreads() {
+		return getJobs().getThreadCount();
+	}
+
+	// Bands of consecutive blocks of blockSize samples, analyzed as the impulse test and
+	// PythonWrapper.py analyze one block, on the worker threads
+	std::vector<std::vector<float>> analyzeAudio(const std::vector<float>& samples, int blockSize, double sampleRate) {
+		std::vector<std::vector<float>> result;
+		if (blockSize <= 0) {
+			return result;
+		}
+		int blockCount = (int)(samples.size() / blockSize);
+		std::vector<float> bands(blockCount * AudioBands::bandCount);
+		AudioBands analysis(blockSize, sampleRate);
+		analysis.analyzeBlocks(samples.data(), blockCount, bands.data(), getJobs());
+		for (int block = 0; block < blockCount; block++) {
+			result.emplace_back(&bands[block * AudioBands::bandCount], &bands[(block + 1) * AudioBands::bandCount]);
+		}
+		return result;
+	}
+
+	// Off, each frame's terrain jobs run on the render thread when the frame starts, and the
+	// startup terrain before the window is opened
+	void setOverlapFrameJobs(bool enabled) {
+		overlapFrameJobs = enabled;
+	}
+
+	// Takes effect from the next runProgram()
+	void setHugePages(bool enabled) {
+		terrainHugePages = enabled;
+	}
+
+	std::tuple<size_t, size_t, size_t, bool> getTerrainMemory() {
+		return std::make_tuple(terrainArena.getBytesUsed(), terrainArena.getPeakBytes(), terrainArena.getBytesReserved(), terrainArena.onHugePages());
+	}
+
+	std::tuple<double, double, double, double, double, double> getStartupTimes() {
+		return std::make_tuple(startupMilliseconds[StartupFirstFrame].load(), startupMilliseconds[StartupContext].load(), startupMilliseconds[StartupBuffers].load(),
+			startupMilliseconds[StartupShaders].load(), startupMilliseconds[StartupTerrainWait].load(), startupMilliseconds[StartupTerrainWork].load());
+	}
+
+	bool startTrace(const std::string& path) {
+#ifdef VISUALIZER_TRACE
+		Trace::start(path);
+		return true;
+#else
+		(void)path;
+		fprintf(stderr, "Tracing is not compiled in; build with VISUALIZER_TRACE defined\n");
+		return false;
+#endif
+	}
+
+	// Also called when the program stops
+	bool stopTrace() {
+#ifdef VISUALIZER_TRACE
+		return Trace::stopAndWrite();
+#else
+		return false;
+#endif
+	}
+
+	std::vector<std::vector<double>> getFrameTimings(int frames) {
+		return frameTimer.getFrames(frames);
+	}
+
+	std::vector<double> getFrameTimingAverages(int frames) {
+		return frameTimer.getAverages(frames);
+	}
+
+	bool saveFrameTimings(const std::string& path) {
+		return frameTimer.writeCsv(path);
+	}
+
+	void setWireframeMode(int mode) {
+		if (mode >= 0 && mode < WireframeModeCount) {
+			wireframeMode = mode;
+		}
+	}
+
+	void benchmarkWireframe(int framesPerMode) {
+		wireframeBenchmark.request(framesPerMode);
+	}
+
+	double getWireframeBenchmarkResult(int mode) {
+		return wireframeBenchmark.getAverage(mode);
 	}
 
 };
 
-OpenGLProgram program = OpenGLProgram();
+OpenGLProgram program;
 
 void runProgram() {
+	TRACE_SCOPE("runProgram");
 	srand(time(NULL));
 	program.defineParams(rand() % 65536, /*wavelength*/ 8, /*octaves*/ 3); // 32, 3
 	program.startOpenGLThread();
 }
 
+bool recordSession(std::string path) {
+	return program.recordSession(path);
+}
+
+void stopSessionRecording() {
+	program.stopSessionRecording();
+}
+
+bool replaySession(std::string path, bool realtime) {
+	if (!program.loadReplay(path, realtime)) {
+		return false;
+	}
+	program.startOpenGLThread();
+	return true;
+}
+
+std::tuple<int, double, bool> getReplayStats() {
+	return program.getReplayStats();
+}
+
 void stopProgram() {
+	TRACE_SCOPE("stopProgram");
 	program.stopThreadGracefully();
 }
 
 void setShaderBrightness(double brightness) {
+	TRACE_SCOPE("setShaderBrightness");
 	program.setShaderBrightness(brightness);
 }
 
-void setMountainHeight(double low, double mid, double high) {
-	program.setMountainHeight(low, mid, high);
+void setMountainHeight(double low, double mid, double high, double captureTime) {
+	TRACE_SCOPE("setMountainHeight");
+	program.setMountainHeight(low, mid, high, captureTime);
+}
+
+double getClockTime() {
+	return AudioLatency::now();
+}
+
+// {stage: (blocks, mean, median, 90th percentile, 99th percentile, max)} in milliseconds
+std::map<std::string, std::tuple<int, double, double, double, double, double>> getAudioLatency() {
+	std::map<std::string, std::tuple<int, double, double, double, double, double>> stages;
+	for (int stage = 0; stage < AudioLatency::StageCount; stage++) {
+		AudioLatency::Summary s = program.getAudioLatency(stage);
+		stages[AudioLatency::stageName(stage)] = std::make_tuple(s.count, s.mean, s.p50, s.p90, s.p99, s.max);
+	}
+	return stages;
+}
+
+void resetAudioLatency() {
+	program.resetAudioLatency();
+}
+
+void startImpulseTest(int clicks, double interval) {
+	program.startImpulseTest(clicks, interval);
+}
+
+bool setHeightGains(int band, double p, double i, double d, double integralDecay) {
+	return program.setHeightGains(band, p, i, d, integralDecay);
+}
+
+bool setHeightSpring(int band, bool enabled, double frequency) {
+	return program.setHeightSpring(band, enabled, frequency);
+}
+
+void stopImpulseTest() {
+	program.stopImpulseTest();
+}
+
+void startRecording(std::string target, int fps) {
+	TRACE_SCOPE("startRecording");
+	program.startRecording(target, fps);
+}
+
+void stopRecording() {
+	TRACE_SCOPE("stopRecording");
+	program.stopRecording();
+}
+
+std::tuple<uint64_t, uint64_t, uint64_t, uint64_t, int> getRecordingStats() {
+	VideoSink::Stats stats = program.getRecordingStats();
+	return std::make_tuple(stats.submitted, stats.written, stats.dropped, stats.late, stats.writeError);
+}
+
+void saveReferenceImage(std::string path) {
+	TRACE_SCOPE("saveReferenceImage");
+	program.saveReferenceImage(path);
+}
+
+int getApiCallsPerFrame() {
+	return program.getApiCallsPerFrame();
+}
+
+int getVisibleChunks() {
+	return program.getVisibleChunks();
+}
+
+int getDrawnTriangles() {
+	return program.getDrawnTriangles();
+}
+
+void setLodErrorThreshold(double pixels) {
+	program.setLodErrorThreshold(pixels);
+}
+
+void benchmarkVertexCache(int frames) {
+	program.benchmarkVertexCache(frames);
+}
+
+void setCacheDisplacedVertices(bool enabled) {
+	program.setCacheDisplacedVertices(enabled);
+}
+
+void setComputeNoise(bool enabled) {
+	program.setComputeNoise(enabled);
+}
+
+bool isComputeNoiseActive() {
+	return program.isComputeNoiseActive();
+}
+
+void checkComputeNoise(bool enabled) {
+	program.checkComputeNoiseAgainstCpu(enabled);
+}
+
+std::tuple<int, double> getComputeNoiseCheckResults() {
+	return program.getComputeNoiseCheckResults();
+}
+
+std::tuple<double, double, double, double> getVertexCacheBenchmarkResults() {
+	return program.getVertexCacheBenchmarkResults();
+}
+
+void setFrameTiming(bool enabled) {
+	program.setFrameTiming(enabled);
+}
+
+void setOverlapFrameJobs(bool enabled) {
+	program.setOverlapFrameJobs(enabled);
+}
+
+std::tuple<double, double, double, double, double, double> getStartupTimes() {
+	return program.getStartupTimes();
+}
+
+void setHugePages(bool enabled) {
+	program.setHugePages(enabled);
+}
+
+std::tuple<size_t, size_t, size_t, bool> getTerrainMemory() {
+	return program.getTerrainMemory();
+}
+
+bool setWorkerThreads(int count, bool pin) {
+	return program.setWorkerThreads(count, pin);
+}
+
+int getWorkerThreads() {
+	return program.getWorkerThreads();
+}
+
+std::vector<std::vector<float>> analyzeAudio(std::vector<float> samples, int blockSize, double sampleRate) {
+	return program.analyzeAudio(samples, blockSize, sampleRate);
+}
+
+bool startTrace(std::string path) {
+	return program.startTrace(path);
+}
+
+bool stopTrace() {
+	return program.stopTrace();
+}
+
+// Rows as {column name: value} so scripts do not depend on the column order
+std::vector<std::map<std::string, double>> getFrameTimings(int frames) {
+	std::vector<std::map<std::string, double>> rows;
+	for (const std::vector<double>& values : program.getFrameTimings(frames)) {
+		std::map<std::string, double> row;
+		for (int c = 0; c < FrameTimer::ColumnCount; c++) {
+			row[FrameTimer::columnName(c)] = values[c];
+		}
+		rows.push_back(row);
+	}
+	return rows;
+}
+
+std::map<std::string, double> getFrameTimingAverages(int frames) {
+	std::vector<double> values = program.getFrameTimingAverages(frames);
+	std::map<std::string, double> averages;
+	for (int c = FrameTimer::Frame + 1; c < FrameTimer::ColumnCount; c++) {
+		averages[FrameTimer::columnName(c)] = values[c];
+	}
+	return averages;
+}
+
+bool saveFrameTimings(std::string path) {
+	return program.saveFrameTimings(path);
+}
+
+void setWireframeMode(int mode) {
+	program.setWireframeMode(mode);
+}
+
+void benchmarkWireframe(int framesPerMode) {
+	program.benchmarkWireframe(framesPerMode);
+}
+
+std::tuple<double, double, double> getWireframeBenchmarkResults() {
+	return std::make_tuple(program.getWireframeBenchmarkResult(WireframeTwoPass), program.getWireframeBenchmarkResult(WireframeSinglePass),
+		program.getWireframeBenchmarkResult(WireframeEdgeLines));
 }
 
 namespace py = pybind11;
@@ -606,12 +2216,138 @@ PYBIND11_MODULE(OpenGL_Experiments, m) {
     )pbdoc")
 	.def("stopProgram", &stopProgram, R"pbdoc(
         Stop the opengl program.
+    )pbdoc")
+	.def("recordSession", &recordSession, R"pbdoc(
+        Record every band, brightness and input update to a file from when the program starts. Call before runProgram; returns False if the program is already running.
+    )pbdoc")
+	.def("stopSessionRecording", &stopSessionRecording, R"pbdoc(
+        Stop the session recording. This also happens when the program stops.
+    )pbdoc")
+	.def("replaySession", &replaySession, R"pbdoc(
+        Run the program from a session recording with its seed and a fixed 60 Hz timestep, in real time or as fast as possible. Call instead of runProgram.
+    )pbdoc")
+	.def("getReplayStats", &getReplayStats, R"pbdoc(
+        Get (frames, seconds, finished) of the session replay.
     )pbdoc")
 	.def("setShaderBrightness", &setShaderBrightness, R"pbdoc(
         Set the brightness of mountain peaks.
     )pbdoc")
-	.def("setMountainHeight", &setMountainHeight, R"pbdoc(
-        Set the height of mountain peaks.
+	.def("setMountainHeight", &setMountainHeight, py::arg("low"), py::arg("mid"), py::arg("high"), py::arg("captureTime") = -1.0, R"pbdoc(
+        Set the height of mountain peaks. captureTime is when the audio block finished recording, from getClockTime().
+    )pbdoc")
+	.def("setHeightGains", &setHeightGains, R"pbdoc(
+        Set the PID gains (band, p, i, d, integralDecay) of a height band: 0 low, 1 mid, 2 high. Gains are per 1/60 s.
+    )pbdoc")
+	.def("setHeightSpring", &setHeightSpring, R"pbdoc(
+        Ease a height band (band, enabled, frequency) with a critically damped spring in place of its PID controller. frequency is in radians per second.
+    )pbdoc")
+	.def("getClockTime", &getClockTime, R"pbdoc(
+        Get the time in seconds of the clock latency stamps use.
+    )pbdoc")
+	.def("getAudioLatency", &getAudioLatency, R"pbdoc(
+        Get {stage: (blocks, mean, median, p90, p99, max)} in milliseconds for captureToAnalysis, analysisToRender, renderToSwap, total and clickToPeak.
+    )pbdoc")
+	.def("resetAudioLatency", &resetAudioLatency, R"pbdoc(
+        Clear the audio latency measurements.
+    )pbdoc")
+	.def("startImpulseTest", &startImpulseTest, R"pbdoc(
+        Drive the mountains from synthetic clicks (count, seconds apart) in place of the audio and measure when each peaks on screen.
+    )pbdoc")
+	.def("stopImpulseTest", &stopImpulseTest, R"pbdoc(
+        Stop the impulse test.
+    )pbdoc")
+	.def("startRecording", &startRecording, R"pbdoc(
+        Record frames as a Y4M stream to a file, or to a process when the target starts with '|'.
+    )pbdoc")
+	.def("stopRecording", &stopRecording, R"pbdoc(
+        Stop recording and flush the Y4M stream.
+    )pbdoc")
+	.def("getRecordingStats", &getRecordingStats, R"pbdoc(
+        Get (submitted, written, dropped, late) frame counts of the current recording, and the errno of the write that stopped it (0 while writes succeed).
+    )pbdoc")
+	.def("saveReferenceImage", &saveReferenceImage, R"pbdoc(
+        Render the next frame with the software rasterizer and save it as a PPM image.
+    )pbdoc")
+	.def("getApiCallsPerFrame", &getApiCallsPerFrame, R"pbdoc(
+        Get the number of OpenGL calls made while rendering the last frame.
+    )pbdoc")
+	.def("getVisibleChunks", &getVisibleChunks, R"pbdoc(
+        Get the number of terrain chunks that passed frustum culling in the last frame.
+    )pbdoc")
+	.def("getDrawnTriangles", &getDrawnTriangles, R"pbdoc(
+        Get the number of terrain triangles drawn in the last frame.
+    )pbdoc")
+	.def("setLodErrorThreshold", &setLodErrorThreshold, R"pbdoc(
+        Set the largest height error in pixels allowed when drawing far chunks at lower density. 0 disables it.
+    )pbdoc")
+	.def("setComputeNoise", &setComputeNoise, R"pbdoc(
+        Generate new chunks with a compute shader when OpenGL 4.3 is available (the default), or always on the CPU. Call before runProgram.
+    )pbdoc")
+	.def("isComputeNoiseActive", &isComputeNoiseActive, R"pbdoc(
+        Whether new chunks are being generated by the compute shader.
+    )pbdoc")
+	.def("checkComputeNoise", &checkComputeNoise, R"pbdoc(
+        Compare every chunk the compute shader generates against the CPU path.
+    )pbdoc")
+	.def("getComputeNoiseCheckResults", &getComputeNoiseCheckResults, R"pbdoc(
+        Get (chunks checked, largest difference) from checkComputeNoise.
+    )pbdoc")
+	.def("setCacheDisplacedVertices", &setCacheDisplacedVertices, R"pbdoc(
+        Composite terrain heights once per frame into a transform feedback buffer and draw every pass from it.
+    )pbdoc")
+	.def("benchmarkVertexCache", &benchmarkVertexCache, R"pbdoc(
+        Time the terrain on the software renderer through a FIFO vertex cache, in row order and vertex cache order.
+    )pbdoc")
+	.def("getVertexCacheBenchmarkResults", &getVertexCacheBenchmarkResults, R"pbdoc(
+        Get (row order ms, reordered ms, row order ACMR, reordered ACMR) from the last vertex cache benchmark.
+    )pbdoc")
+	.def("startTrace", &startTrace, R"pbdoc(
+        Record trace zones of every thread, to be written to the given file as Chrome trace JSON. Needs a build with VISUALIZER_TRACE defined.
+    )pbdoc")
+	.def("stopTrace", &stopTrace, R"pbdoc(
+        Stop recording the trace and write it. This also happens when the program stops.
+    )pbdoc")
+	.def("setFrameTiming", &setFrameTiming, R"pbdoc(
+        Time every frame's CPU phases and GPU passes. GPU times arrive a few frames late.
+    )pbdoc")
+	.def("getStartupTimes", &getStartupTimes, R"pbdoc(
+        Get the milliseconds from runProgram() to the first frame shown, then the render thread's time creating the context, creating the buffers, compiling the shaders and waiting for the startup terrain, and the time the startup terrain jobs took.
+    )pbdoc")
+	.def("setHugePages", &setHugePages, R"pbdoc(
+        Keep the terrain arrays on huge pages where the system allows it. Call before runProgram().
+    )pbdoc")
+	.def("getTerrainMemory", &getTerrainMemory, R"pbdoc(
+        Get the bytes of terrain storage in use, the most ever in use and the bytes reserved from the system, and whether they are on huge pages.
+    )pbdoc")
+	.def("setWorkerThreads", &setWorkerThreads, py::arg("count"), py::arg("pin") = false, R"pbdoc(
+        Set the number of worker threads (-1 for one per core but one) and whether each is pinned to its own core. Call before runProgram().
+    )pbdoc")
+	.def("getWorkerThreads", &getWorkerThreads, R"pbdoc(
+        Get the number of worker threads, starting them if they have not started.
+    )pbdoc")
+	.def("analyzeAudio", &analyzeAudio, py::arg("samples"), py::arg("blockSize") = 1764, py::arg("sampleRate") = 44100.0, R"pbdoc(
+        Get the (low, mid, high) band levels of each whole block of samples, analyzed in parallel on the worker threads.
+    )pbdoc")
+	.def("setOverlapFrameJobs", &setOverlapFrameJobs, R"pbdoc(
+        Prepare each frame's terrain on worker threads while the previous frame is drawn (default), or on the render thread.
+    )pbdoc")
+	.def("getFrameTimings", &getFrameTimings, R"pbdoc(
+        Get the last frames' timings (up to 1024, 0 for all) as dicts of milliseconds per phase, oldest first.
+    )pbdoc")
+	.def("getFrameTimingAverages", &getFrameTimingAverages, R"pbdoc(
+        Get the average milliseconds of each phase over the last frames (0 for all held).
+    )pbdoc")
+	.def("saveFrameTimings", &saveFrameTimings, R"pbdoc(
+        Write the held frame timings to a CSV file.
+    )pbdoc")
+	.def("setWireframeMode", &setWireframeMode, R"pbdoc(
+        Draw the wireframe in two passes (0), in a single pass with the fill (1), or as unique edge lines (2).
+    )pbdoc")
+	.def("benchmarkWireframe", &benchmarkWireframe, R"pbdoc(
+        Time the terrain draws on the GPU for the given number of frames in each wireframe mode.
+    )pbdoc")
+	.def("getWireframeBenchmarkResults", &getWireframeBenchmarkResults, R"pbdoc(
+        Get the (two pass, single pass, edge lines) average GPU milliseconds per frame of the last benchmark.
     )pbdoc");
 
 #ifdef VERSION_INFO
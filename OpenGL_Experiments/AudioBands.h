@@ -0,0 +1,148 @@
+#pragma once
+#include <math.h>
+#include <algorithm>
+#include <complex>
+#include <vector>
+#include "JobSystem.h"
+
+// The band extraction behind PythonWrapper.py: log10 |FFT| of a block of samples, summed into
+// bands below 100 Hz, 100 to 1000 Hz and above 1000 Hz. Each band is (mean + max) / 2, where
+// the max starts at 0 and runs over the band and every band before it. The FFT is mixed radix,
+// so block sizes like the wrapper's 1764 samples (40 ms at 44.1 kHz) need no padding.
+class AudioBands {
+public:
+	static const int bandCount = 3;
+
+	AudioBands(int aSampleCount, double sampleRate) {
+		sampleCount = aSampleCount;
+		for (int n = sampleCount, p = 2; n > 1;) {
+			if (n % p == 0) {
+				factors.push_back(p);
+				n /= p;
+			}
+			else {
+				p++;
+			}
+		}
+		twiddles.resize(sampleCount);
+		for (int i = 0; i < sampleCount; i++) {
+			double angle = -2.0 * 3.14159265358979323846 * i / sampleCount;
+			twiddles[i] = std::complex<double>(cos(angle), sin(angle));
+		}
+		scratch.resize(1);
+		scratch[0].input.resize(sampleCount);
+		scratch[0].spectrum.resize(sampleCount);
+		bandEnds[0] = (int)(100.0 * sampleCount / sampleRate) + 1;
+		bandEnds[1] = (int)(1000.0 * sampleCount / sampleRate) + 1;
+		bandEnds[2] = sampleCount / 2 + 1;
+	}
+
+	int getSampleCount() const {
+		return sampleCount;
+	}
+
+	// samples holds sampleCount values in [-1, 1]
+	void analyze(const float* samples, float bands[bandCount]) {
+		analyze(scratch[0], samples, bands);
+	}
+
+	// blockCount consecutive blocks of sampleCount samples, analyzed in parallel on jobs. bands
+	// receives bandCount values per block.
+	void analyzeBlocks(const float* samples, int blockCount, float* bands, JobSystem& jobs) {
+		while ((int)scratch.size() < jobs.getMaxSlots()) {
+			scratch.emplace_back();
+			scratch.back().input.resize(sampleCount);
+			scratch.back().spectrum.resize(sampleCount);
+		}
+		jobs.parallelFor("audio blocks", 0, blockCount, 1, [&](int begin, int end, int slot) {
+			for (int block = begin; block < end; block++) {
+				analyze(scratch[slot], samples + (size_t)block * sampleCount, bands + block * bandCount);
+			}
+		});
+	}
+
+	// Plain DFT of the last block analyze() was given, for checking the FFT
+	std::vector<std::complex<double>> referenceSpectrum() const {
+		const std::vector<std::complex<double>>& input = scratch[0].input;
+		std::vector<std::complex<double>> out(sampleCount);
+		for (int k = 0; k < sampleCount; k++) {
+			for (int i = 0; i < sampleCount; i++) {
+				out[k] += input[i] * twiddles[(long long)i * k % sampleCount];
+			}
+		}
+		return out;
+	}
+
+	const std::vector<std::complex<double>>& getSpectrum() const {
+		return scratch[0].spectrum;
+	}
+
+private:
+	struct Scratch {
+		std::vector<std::complex<double>> input;
+		std::vector<std::complex<double>> spectrum;
+	};
+
+	void analyze(Scratch& work, const float* samples, float bands[bandCount]) const {
+		for (int i = 0; i < sampleCount; i++) {
+			work.input[i] = samples[i];
+		}
+		transform(work.input.data(), work.spectrum.data(), sampleCount, 1, 0);
+		const std::vector<std::complex<double>>& spectrum = work.spectrum;
+
+		int index = 0;
+		double runningMax = 0.0;
+		for (int b = 0; b < bandCount; b++) {
+			int first = index;
+			double sum = 0.0;
+			for (; index < bandEnds[b] && index < sampleCount; index++) {
+				double value = log10(std::abs(spectrum[index]));
+				sum += value;
+				runningMax = std::max(runningMax, value);
+			}
+			bands[b] = index > first ? (float)((sum / (index - first) + runningMax) / 2.0) : 0.0f;
+		}
+	}
+
+	// Decimation in time: transforms the n samples in[0], in[stride], ... into out[0 .. n)
+	void transform(const std::complex<double>* in, std::complex<double>* out, int n, int stride, size_t level) const {
+		if (n == 1) {
+			out[0] = in[0];
+			return;
+		}
+		int radix = factors[level];
+		int m = n / radix;
+		for (int q = 0; q < radix; q++) {
+			transform(in + q * stride, out + q * m, m, stride * radix, level + 1);
+		}
+		// Twiddle steps at this level are multiples of sampleCount / n
+		int step = sampleCount / n;
+		std::complex<double> terms[maxInlineRadix];
+		std::vector<std::complex<double>> largeTerms;
+		std::complex<double>* t = terms;
+		if (radix > maxInlineRadix) {
+			largeTerms.resize(radix);
+			t = largeTerms.data();
+		}
+		for (int k = 0; k < m; k++) {
+			for (int q = 0; q < radix; q++) {
+				t[q] = out[q * m + k] * twiddles[(q * k * step) % sampleCount];
+			}
+			for (int s = 0; s < radix; s++) {
+				std::complex<double> sum = 0.0;
+				for (int q = 0; q < radix; q++) {
+					sum += t[q] * twiddles[(q * s * m * step) % sampleCount];
+				}
+				out[s * m + k] = sum;
+			}
+		}
+	}
+
+	static const int maxInlineRadix = 16;
+
+	int sampleCount;
+	int bandEnds[bandCount];
+	std::vector<int> factors;
+	std::vector<std::complex<double>> twiddles;
+	std::vector<Scratch> scratch; // analyze() uses the first; analyzeBlocks() one per slot
+};
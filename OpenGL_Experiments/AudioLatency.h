@@ -0,0 +1,160 @@
+#pragma once
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+// Audio-to-photon latency. Each audio block is stamped when it was captured and when its band
+// levels reached the native module. The render thread then stamps the first frame that steps the
+// height controllers towards them, and the buffer swap that shows that frame. For test clicks it
+// also finds the swap at which the drawn height peaks.
+class AudioLatency {
+public:
+	enum Stage { CaptureToAnalysis, AnalysisToRender, RenderToSwap, Total, ClickToPeak, StageCount };
+	static const int samplesPerStage = 4096; // the most recent blocks are kept
+
+	// Milliseconds
+	struct Summary {
+		int count = 0;
+		double mean = 0.0;
+		double p50 = 0.0;
+		double p90 = 0.0;
+		double p99 = 0.0;
+		double max = 0.0;
+	};
+
+	static const char* stageName(int stage) {
+		static const char* names[StageCount] = { "captureToAnalysis", "analysisToRender", "renderToSwap", "total", "clickToPeak" };
+		return stage >= 0 && stage < StageCount ? names[stage] : "";
+	}
+
+	// Seconds on the clock every stamp uses
+	static double now() {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// Any thread, after the controllers' targets are set. captureTime is from now(), or negative
+	// when the caller has no stamp and the block counts from its arrival. clickTime is the onset of
+	// a test click in the block, or negative.
+	void blockArrived(double captureTime, double clickTime = -1.0) {
+		std::lock_guard<std::mutex> lock(mutex);
+		pending.capture = captureTime;
+		pending.arrival = now();
+		pending.click = clickTime;
+		hasPending = true;
+	}
+
+	// Render thread, after the controllers have stepped
+	void frameUpdated() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!hasPending) {
+			return;
+		}
+		current = pending;
+		current.update = now();
+		hasPending = false;
+		hasCurrent = true;
+		if (current.click >= 0.0) {
+			clickTime = current.click;
+			peakHeight = -HUGE_VAL;
+		}
+	}
+
+	// Render thread, after the swap. drawnHeight is any measure that rises with the drawn heights.
+	void frameSwapped(double drawnHeight) {
+		double swap = now();
+		if (hasCurrent) {
+			std::lock_guard<std::mutex> lock(mutex);
+			double start = current.capture >= 0.0 ? current.capture : current.arrival;
+			if (current.capture >= 0.0) {
+				add(CaptureToAnalysis, current.arrival - current.capture);
+			}
+			add(AnalysisToRender, current.update - current.arrival);
+			add(RenderToSwap, swap - current.update);
+			add(Total, swap - start);
+			hasCurrent = false;
+		}
+		// The first swap after which the height falls is the peak
+		if (clickTime >= 0.0) {
+			if (drawnHeight > peakHeight) {
+				peakHeight = drawnHeight;
+				peakSwap = swap;
+			}
+			else {
+				std::lock_guard<std::mutex> lock(mutex);
+				add(ClickToPeak, peakSwap - clickTime);
+				clickTime = -1.0;
+			}
+		}
+	}
+
+	Summary getSummary(int stage) {
+		Summary summary;
+		if (stage < 0 || stage >= StageCount) {
+			return summary;
+		}
+		std::vector<double> values;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			values = samples[stage];
+		}
+		if (values.empty()) {
+			return summary;
+		}
+		std::sort(values.begin(), values.end());
+		double sum = 0.0;
+		for (double value : values) {
+			sum += value;
+		}
+		size_t last = values.size() - 1;
+		summary.count = (int)values.size();
+		summary.mean = sum / values.size();
+		summary.p50 = values[last * 50 / 100];
+		summary.p90 = values[last * 90 / 100];
+		summary.p99 = values[last * 99 / 100];
+		summary.max = values[last];
+		return summary;
+	}
+
+	void reset() {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int s = 0; s < StageCount; s++) {
+			samples[s].clear();
+			nextSample[s] = 0;
+		}
+	}
+
+private:
+	struct Block {
+		double capture = -1.0;
+		double arrival = 0.0;
+		double update = 0.0;
+		double click = -1.0;
+	};
+
+	// Called with the mutex held
+	void add(Stage stage, double seconds) {
+		std::vector<double>& values = samples[stage];
+		if ((int)values.size() < samplesPerStage) {
+			values.push_back(seconds * 1000.0);
+		}
+		else {
+			values[nextSample[stage]] = seconds * 1000.0;
+		}
+		nextSample[stage] = (nextSample[stage] + 1) % samplesPerStage;
+	}
+
+	std::mutex mutex;
+	Block pending;
+	bool hasPending = false;
+	std::vector<double> samples[StageCount];
+	int nextSample[StageCount] = {};
+
+	// Render thread only
+	Block current;
+	bool hasCurrent = false;
+	double clickTime = -1.0;
+	double peakHeight = 0.0;
+	double peakSwap = 0.0;
+};
@@ -0,0 +1,87 @@
+#pragma once
+#include <vector>
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+struct Aabb {
+	glm::vec3 min;
+	glm::vec3 max;
+};
+
+// The six clip planes of a view-projection matrix (Gribb & Hartmann), pointing inwards
+class Frustum {
+public:
+	void extract(const glm::mat4& MVP) {
+		// glm is column major, so row r of the matrix is (MVP[0][r], MVP[1][r], MVP[2][r], MVP[3][r])
+		glm::vec4 rows[4];
+		for (int r = 0; r < 4; r++) {
+			rows[r] = glm::vec4(MVP[0][r], MVP[1][r], MVP[2][r], MVP[3][r]);
+		}
+		planes[0] = rows[3] + rows[0]; // left
+		planes[1] = rows[3] - rows[0]; // right
+		planes[2] = rows[3] + rows[1]; // bottom
+		planes[3] = rows[3] - rows[1]; // top
+		planes[4] = rows[3] + rows[2]; // near
+		planes[5] = rows[3] - rows[2]; // far
+	}
+
+	// Conservative: a box outside no single plane counts as visible
+	bool intersects(const Aabb& box) const {
+		for (const glm::vec4& plane : planes) {
+			// The corner furthest along the plane normal
+			glm::vec3 corner(
+				plane.x >= 0.0f ? box.max.x : box.min.x,
+				plane.y >= 0.0f ? box.max.y : box.min.y,
+				plane.z >= 0.0f ? box.max.z : box.min.z);
+			if (glm::dot(glm::vec3(plane), corner) + plane.w < 0.0f) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	glm::vec4 planes[6];
+};
+
+// Instanced draws of index ranges over an unsigned short element buffer. An instance that
+// continues the previous draw with the same range is merged into it.
+class DrawList {
+public:
+	struct Draw {
+		GLsizei firstIndex;
+		GLsizei count;
+		GLuint baseInstance;
+		GLsizei instanceCount;
+	};
+
+	void clear() {
+		draws.clear();
+	}
+
+	// Room for count draws, so filling the list each frame allocates nothing
+	void reserve(int count) {
+		draws.reserve(count);
+	}
+
+	void add(GLsizei firstIndex, GLsizei count, GLuint instance) {
+		if (count <= 0) {
+			return;
+		}
+		if (!draws.empty()) {
+			Draw& last = draws.back();
+			if (last.firstIndex == firstIndex && last.count == count && last.baseInstance + last.instanceCount == instance) {
+				last.instanceCount++;
+				return;
+			}
+		}
+		draws.push_back({ firstIndex, count, instance, 1 });
+	}
+
+	const std::vector<Draw>& getDraws() const {
+		return draws;
+	}
+
+private:
+	std::vector<Draw> draws;
+};
@@ -0,0 +1,120 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <GL/glew.h>
+#include "RenderState.h"
+
+// Generates a chunk's band noise with a compute shader, which writes the texels straight into the
+// noise ring the terrain vertex shader samples. The same texels go to a readback buffer so the
+// CPU still gets the values it needs for bounds and levels of detail; they are read a frame or
+// more later behind a fence, so generation never stalls the pipeline.
+class ChunkNoiseCompute {
+public:
+	// Bindings used by the compute shader
+	static const GLuint permutationBinding = 0;
+	static const GLuint texelsBinding = 1;
+	static const GLuint ringImageUnit = 0;
+
+	static bool isSupported() {
+		return GLEW_VERSION_4_3;
+	}
+
+	// The permutation siv::PerlinNoise::reseed(seed) builds, repeated twice
+	static std::vector<GLint> permutation(std::uint32_t seed) {
+		std::uint8_t p[256];
+		for (int i = 0; i < 256; i++) {
+			p[i] = (std::uint8_t)i;
+		}
+		std::shuffle(p, p + 256, std::default_random_engine(seed));
+		std::vector<GLint> table(512);
+		for (int i = 0; i < 512; i++) {
+			table[i] = p[i & 255];
+		}
+		return table;
+	}
+
+	bool init(RenderState& state, GLuint aProgramID, std::uint32_t seed, const float* peaks, int aGridSize, int aChunkCount) {
+		programID = aProgramID;
+		gridSize = aGridSize;
+		chunkCount = aChunkCount;
+		if (programID == 0) {
+			return false;
+		}
+		noiseRowLocation = glGetUniformLocation(programID, "noiseRow");
+		wavelengthLocation = glGetUniformLocation(programID, "wavelength");
+		firstRingRowLocation = glGetUniformLocation(programID, "firstRingRow");
+		texelOffsetLocation = glGetUniformLocation(programID, "texelOffset");
+		state.useProgram(programID);
+		glUniform1fv(glGetUniformLocation(programID, "peaks"), gridSize, peaks);
+
+		std::vector<GLint> table = permutation(seed);
+		glGenBuffers(1, &permutationBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, permutationBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, table.size() * sizeof(GLint), table.data(), GL_STATIC_DRAW);
+
+		glGenBuffers(1, &texelsBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, texelsBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, chunkTexelCount() * chunkCount * sizeof(GLfloat), NULL, GL_DYNAMIC_READ);
+		pending.assign(chunkCount, 0);
+		return true;
+	}
+
+	// Fills a chunk's rows of the ring, starting at firstRingRow and wrapping
+	void generate(RenderState& state, int arrayPos, double noiseRow, double wavelength, int firstRingRow, GLuint ringTexture) {
+		state.useProgram(programID);
+		glUniform1d(noiseRowLocation, noiseRow);
+		glUniform1d(wavelengthLocation, wavelength);
+		glUniform1i(firstRingRowLocation, firstRingRow);
+		glUniform1i(texelOffsetLocation, arrayPos * gridSize * gridSize);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, permutationBinding, permutationBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, texelsBinding, texelsBuffer);
+		glBindImageTexture(ringImageUnit, ringTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+		glDispatchCompute(1, 1, 1);
+		// Later draws sample the ring, and the readback copies from the texel buffer
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+		if (pending[arrayPos]) {
+			glDeleteSync(pending[arrayPos]);
+		}
+		pending[arrayPos] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		state.countCall(10); // uniforms, bindings, dispatch, barrier and fence
+	}
+
+	// Copies out one chunk whose generation has finished, as (n1, n2, n3, peak) per texel.
+	// Returns its array position, or -1 if none is ready.
+	int collect(std::vector<GLfloat>& texels) {
+		for (int k = 0; k < chunkCount; k++) {
+			if (!pending[k]) {
+				continue;
+			}
+			GLenum status = glClientWaitSync(pending[k], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+			if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+				continue;
+			}
+			glDeleteSync(pending[k]);
+			pending[k] = 0;
+			texels.resize(chunkTexelCount());
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, texelsBuffer);
+			glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, k * chunkTexelCount() * sizeof(GLfloat), chunkTexelCount() * sizeof(GLfloat), texels.data());
+			return k;
+		}
+		return -1;
+	}
+
+private:
+	size_t chunkTexelCount() const {
+		return (size_t)gridSize * gridSize * 4;
+	}
+
+	GLuint programID = 0;
+	int gridSize = 0;
+	int chunkCount = 0;
+	GLint noiseRowLocation = -1;
+	GLint wavelengthLocation = -1;
+	GLint firstRingRowLocation = -1;
+	GLint texelOffsetLocation = -1;
+	GLuint permutationBuffer = 0;
+	GLuint texelsBuffer = 0;
+	std::vector<GLsync> pending;
+};
@@ -0,0 +1,69 @@
+#pragma once
+#include <vector>
+#include <GL/glew.h>
+#include "RenderState.h"
+
+// Displaces every chunk's vertices once per frame into a transform feedback buffer, so passes
+// that draw the same terrain share one run of the displacement shader. The buffer holds a vec4
+// per grid vertex, chunk after chunk, and passes read it through a buffer texture indexed by
+// chunk and gl_VertexID. Their vertex array has the chunk index as a per-instance attribute and
+// the same element buffer, so they keep drawing the same instanced index ranges.
+class DisplacedVertexCache {
+public:
+	static const GLuint textureUnit = 1;
+
+	void init(RenderState& state, int aVerticesPerChunk, int aChunkCount, GLuint elementBuffer) {
+		verticesPerChunk = aVerticesPerChunk;
+		chunkCount = aChunkCount;
+
+		glGenBuffers(1, &feedbackBuffer);
+		glBindBuffer(GL_TRANSFORM_FEEDBACK_BUFFER, feedbackBuffer);
+		glBufferData(GL_TRANSFORM_FEEDBACK_BUFFER, verticesPerChunk * chunkCount * 4 * sizeof(GLfloat), NULL, GL_DYNAMIC_COPY);
+
+		glGenTextures(1, &feedbackTexture);
+		glActiveTexture(GL_TEXTURE0 + textureUnit);
+		glBindTexture(GL_TEXTURE_BUFFER, feedbackTexture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, feedbackBuffer);
+		glActiveTexture(GL_TEXTURE0);
+
+		std::vector<GLfloat> chunkIndices(chunkCount);
+		for (int k = 0; k < chunkCount; k++) {
+			chunkIndices[k] = (GLfloat)k;
+		}
+		glGenVertexArrays(1, &vertexArray);
+		state.bindVertexArray(vertexArray);
+		glGenBuffers(1, &chunkIndexBuffer);
+		state.bindBuffer(GL_ARRAY_BUFFER, chunkIndexBuffer);
+		glBufferData(GL_ARRAY_BUFFER, chunkIndices.size() * sizeof(GLfloat), chunkIndices.data(), GL_STATIC_DRAW);
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 1, GL_FLOAT, GL_FALSE, 0, (void*)0);
+		glVertexAttribDivisor(0, 1);
+		state.setInstanceAttribute(vertexArray, chunkIndexBuffer, 0, 1);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementBuffer);
+	}
+
+	// Runs the program in use, which must capture one vec4 per vertex, over every chunk of the
+	// grid vertex array. Instances are processed in order, so chunk k lands at k * verticesPerChunk.
+	void capture(RenderState& state, GLuint gridVertexArray) {
+		state.bindVertexArray(gridVertexArray);
+		state.setEnabled(GL_RASTERIZER_DISCARD, true);
+		glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, feedbackBuffer);
+		glBeginTransformFeedback(GL_POINTS);
+		state.drawArraysInstanced(GL_POINTS, 0, verticesPerChunk, chunkCount);
+		glEndTransformFeedback();
+		state.setEnabled(GL_RASTERIZER_DISCARD, false);
+		state.countCall(3);
+	}
+
+	GLuint getVertexArray() const {
+		return vertexArray;
+	}
+
+private:
+	int verticesPerChunk = 0;
+	int chunkCount = 0;
+	GLuint feedbackBuffer = 0;
+	GLuint feedbackTexture = 0;
+	GLuint vertexArray = 0;
+	GLuint chunkIndexBuffer = 0;
+};
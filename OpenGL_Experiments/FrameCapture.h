@@ -0,0 +1,135 @@
+#pragma once
+#include <GL/glew.h>
+#include <mutex>
+#include <string>
+#include "VideoSink.h"
+
+// Reads back the default framebuffer through a ring of pixel buffer objects and hands the
+// pixels to a VideoSink. Readback of frame N is only mapped on frame N + pboCount - 1, so the
+// render thread never waits on the GPU. Start/stop requests may come from any thread and are
+// applied on the GL thread at the next captured frame.
+class FrameCapture {
+public:
+	void requestStart(const std::string& target, int fps) {
+		std::lock_guard<std::mutex> lock(requestMutex);
+		pendingTarget = target;
+		pendingFps = fps;
+		pendingRequest = RequestStart;
+	}
+
+	void requestStop() {
+		std::lock_guard<std::mutex> lock(requestMutex);
+		pendingRequest = RequestStop;
+	}
+
+	VideoSink::Stats getStats() const {
+		return sink.getStats();
+	}
+
+	// Call on the GL thread after drawing and before swapping buffers
+	void captureFrame(int width, int height) {
+		applyRequest(width, height, true);
+		if (!sink.isOpen()) {
+			return;
+		}
+
+		GLsizeiptr size = (GLsizeiptr)width * height * 4;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[pboIndex]);
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+		pboFilled[pboIndex] = true;
+
+		// The oldest buffer in the ring was read back pboCount - 1 frames ago
+		int readIndex = (pboIndex + 1) % pboCount;
+		if (pboFilled[readIndex]) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[readIndex]);
+			void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+			if (pixels != NULL) {
+				VideoSink::Frame* frame = sink.acquireFrame();
+				if (frame != NULL) {
+					memcpy(frame->rgba.data(), pixels, size);
+					sink.submitFrame(frame);
+				}
+				glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			}
+			pboFilled[readIndex] = false;
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		pboIndex = readIndex;
+	}
+
+	// Software rendering path: pixels are RGBA8 with the bottom row first, like glReadPixels
+	void submitPixels(const uint8_t* rgba, int width, int height) {
+		applyRequest(width, height, false);
+		if (!sink.isOpen()) {
+			return;
+		}
+		VideoSink::Frame* frame = sink.acquireFrame();
+		if (frame != NULL) {
+			memcpy(frame->rgba.data(), rgba, (size_t)width * height * 4);
+			sink.submitFrame(frame);
+		}
+	}
+
+	// Call on the GL thread before the context is destroyed
+	void shutdown() {
+		sink.close();
+		releaseBuffers();
+	}
+
+private:
+	enum Request { RequestNone, RequestStart, RequestStop };
+	static const int pboCount = 3;
+
+	void applyRequest(int width, int height, bool readback) {
+		std::string target;
+		int fps;
+		Request request;
+		{
+			std::lock_guard<std::mutex> lock(requestMutex);
+			request = pendingRequest;
+			target = pendingTarget;
+			fps = pendingFps;
+			pendingRequest = RequestNone;
+		}
+		if (request == RequestNone && (!sink.isOpen() || (sink.getWidth() == width && sink.getHeight() == height && !sink.hasFailed()))) {
+			return;
+		}
+
+		// A resized framebuffer or a failed write ends the current recording
+		sink.close();
+		releaseBuffers();
+		if (request != RequestStart) {
+			return;
+		}
+		if (!sink.open(target, width, height, fps, /*bottomUp*/ true) || !readback) {
+			return;
+		}
+		glGenBuffers(pboCount, pbos);
+		for (int i = 0; i < pboCount; i++) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+			glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width * height * 4, NULL, GL_STREAM_READ);
+			pboFilled[i] = false;
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		pboIndex = 0;
+	}
+
+	void releaseBuffers() {
+		if (pbos[0] != 0) {
+			glDeleteBuffers(pboCount, pbos);
+			for (int i = 0; i < pboCount; i++) {
+				pbos[i] = 0;
+			}
+		}
+	}
+
+	VideoSink sink;
+	GLuint pbos[pboCount] = { 0, 0, 0 };
+	bool pboFilled[pboCount] = { false, false, false };
+	int pboIndex = 0;
+
+	std::mutex requestMutex;
+	Request pendingRequest = RequestNone;
+	std::string pendingTarget;
+	int pendingFps = 60;
+};
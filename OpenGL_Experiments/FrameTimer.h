@@ -0,0 +1,293 @@
+#pragma once
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <GL/glew.h>
+
+// Per-frame timing of the render loop. CPU phases are laps of a steady clock and GPU passes are
+// GL_TIME_ELAPSED queries, read back a few frames later so timing never waits on the GPU.
+// Finished frames go into a ring that any thread can read without locking: a slot's sequence
+// number is odd while the render thread writes it, and a reader keeps its copy only if the
+// number was the expected even value before and after copying.
+class FrameTimer {
+public:
+	// Milliseconds, except Frame. GPU columns are NaN when the pass was not timed.
+	enum Column {
+		Frame,
+		Total,        // the whole frame, including the wait
+		Wait,         // sleeping to hold the frame rate
+		Prepare,      // starting the next frame's terrain jobs and waiting for this frame's, or running them here
+		Update,       // height controllers
+		Upload,       // chunk uploads or compute dispatches, and collecting generated chunks
+		Scene,        // input, camera, uniforms, level of detail selection and culling
+		Submit,       // issuing the terrain draws
+		Capture,      // recording, reference images and requested benchmarks
+		Swap,         // buffer swap and event polling
+		CpuBusy,      // Total without Wait
+		PrepareWork,  // time the jobs that prepared this frame's terrain ran for, on any thread
+		GpuUpload,
+		GpuDisplace,  // transform feedback of displaced vertices
+		GpuFill,
+		GpuWireframe,
+		GpuTotal,     // sum of the timed passes
+		ColumnCount
+	};
+	static const int capacity = 1024; // frames kept in the ring
+
+	FrameTimer() : slots(new Slot[capacity]) {
+	}
+
+	static const char* columnName(int column) {
+		static const char* names[ColumnCount] = {
+			"frame", "total", "wait", "prepare", "update", "upload", "scene", "submit", "capture", "swap", "cpuBusy",
+			"prepareWork", "gpuUpload", "gpuDisplace", "gpuFill", "gpuWireframe", "gpuTotal"
+		};
+		return column >= 0 && column < ColumnCount ? names[column] : "";
+	}
+
+	// May be called from any thread; takes effect on the next frame
+	void setEnabled(bool enabled) {
+		requestedEnabled = enabled;
+	}
+
+	// Render thread. hasGpu is false on the software renderer.
+	void beginFrame(bool hasGpu) {
+		active = requestedEnabled;
+		if (!active) {
+			return;
+		}
+		gpuActive = hasGpu;
+		if (gpuActive && !queriesCreated) {
+			for (PendingFrame& pending : frames) {
+				glGenQueries(gpuPassCount, pending.queries);
+			}
+			queriesCreated = true;
+			// llvmpipe times the first query of a context from zero, so leave this frame's passes out
+			gpuActive = false;
+		}
+		collect();
+		// The slot is still waiting for GPU results from queueFrames frames ago: give up on them
+		while (frameNumber - nextToPublish >= queueFrames) {
+			publish(frames[nextToPublish % queueFrames], false);
+			nextToPublish++;
+		}
+		PendingFrame& frame = frames[frameNumber % queueFrames];
+		for (int c = 0; c < ColumnCount; c++) {
+			frame.values[c] = c >= GpuUpload ? NAN : 0.0;
+		}
+		frame.values[Frame] = (double)frameNumber;
+		for (bool& timed : frame.timed) {
+			timed = false;
+		}
+		frameStart = lapStart = Clock::now();
+	}
+
+	// Adds the time since the previous lap (or the start of the frame) to a CPU phase
+	void lap(Column phase) {
+		if (!active) {
+			return;
+		}
+		Clock::time_point now = Clock::now();
+		frames[frameNumber % queueFrames].values[phase] += milliseconds(now - lapStart);
+		lapStart = now;
+	}
+
+	// Adds time measured elsewhere, such as on other threads
+	void add(Column column, double ms) {
+		if (!active) {
+			return;
+		}
+		frames[frameNumber % queueFrames].values[column] += ms;
+	}
+
+	// GPU passes cannot overlap each other or another GL_TIME_ELAPSED query
+	void beginGpu(Column pass) {
+		if (!active || !gpuActive) {
+			return;
+		}
+		PendingFrame& frame = frames[frameNumber % queueFrames];
+		glBeginQuery(GL_TIME_ELAPSED, frame.queries[pass - GpuUpload]);
+		frame.timed[pass - GpuUpload] = true;
+		activePass = pass;
+	}
+
+	void endGpu() {
+		if (activePass < 0) {
+			return;
+		}
+		glEndQuery(GL_TIME_ELAPSED);
+		activePass = -1;
+	}
+
+	// Stops timing GPU passes for the rest of the frame, while something else owns the query target
+	void suspendGpu() {
+		gpuActive = false;
+	}
+
+	void endFrame() {
+		if (!active) {
+			return;
+		}
+		PendingFrame& frame = frames[frameNumber % queueFrames];
+		frame.values[Total] = milliseconds(Clock::now() - frameStart);
+		frame.values[CpuBusy] = frame.values[Total] - frame.values[Wait];
+		frameNumber++;
+		collect();
+	}
+
+	// Any thread. The last count finished frames, oldest first; slots overwritten while being
+	// read are skipped.
+	std::vector<std::vector<double>> getFrames(int count) const {
+		std::vector<std::vector<double>> rows;
+		uint64_t end = written.load(std::memory_order_acquire);
+		uint64_t available = end < (uint64_t)capacity ? end : (uint64_t)capacity;
+		uint64_t wanted = count > 0 && (uint64_t)count < available ? (uint64_t)count : available;
+		std::vector<double> row(ColumnCount);
+		for (uint64_t n = end - wanted; n < end; n++) {
+			if (read(n, row.data())) {
+				rows.push_back(row);
+			}
+		}
+		return rows;
+	}
+
+	// Mean of each column over the last count frames, skipping frames where it was not timed
+	std::vector<double> getAverages(int count) const {
+		std::vector<double> sums(ColumnCount, 0.0);
+		std::vector<int> counts(ColumnCount, 0);
+		for (const std::vector<double>& row : getFrames(count)) {
+			for (int c = 0; c < ColumnCount; c++) {
+				if (!isnan(row[c])) {
+					sums[c] += row[c];
+					counts[c]++;
+				}
+			}
+		}
+		for (int c = 0; c < ColumnCount; c++) {
+			sums[c] = counts[c] > 0 ? sums[c] / counts[c] : NAN;
+		}
+		return sums;
+	}
+
+	// Every frame in the ring, one row per frame; untimed GPU passes are left empty
+	bool writeCsv(const std::string& path) const {
+		FILE* file = fopen(path.c_str(), "w");
+		if (!file) {
+			fprintf(stderr, "Could not open %s for writing\n", path.c_str());
+			return false;
+		}
+		for (int c = 0; c < ColumnCount; c++) {
+			fprintf(file, c == 0 ? "%s" : ",%s", columnName(c));
+		}
+		fprintf(file, "\n");
+		for (const std::vector<double>& row : getFrames(capacity)) {
+			fprintf(file, "%.0f", row[Frame]);
+			for (int c = Frame + 1; c < ColumnCount; c++) {
+				if (isnan(row[c])) {
+					fprintf(file, ",");
+				}
+				else {
+					fprintf(file, ",%.4f", row[c]);
+				}
+			}
+			fprintf(file, "\n");
+		}
+		return fclose(file) == 0;
+	}
+
+private:
+	typedef std::chrono::steady_clock Clock;
+	static const int gpuPassCount = ColumnCount - 1 - GpuUpload; // GpuTotal is derived
+	static const int queueFrames = 4;
+
+	struct PendingFrame {
+		double values[ColumnCount];
+		GLuint queries[gpuPassCount] = {};
+		bool timed[gpuPassCount] = {};
+	};
+
+	struct Slot {
+		std::atomic<uint64_t> sequence{ 0 };
+		std::atomic<double> values[ColumnCount];
+	};
+
+	static double milliseconds(Clock::duration duration) {
+		return std::chrono::duration<double, std::milli>(duration).count();
+	}
+
+	// Publishes finished frames in order, stopping at the first whose GPU results are not in yet
+	void collect() {
+		while (nextToPublish < frameNumber) {
+			PendingFrame& frame = frames[nextToPublish % queueFrames];
+			for (int p = 0; p < gpuPassCount; p++) {
+				GLint available = GL_TRUE;
+				if (frame.timed[p]) {
+					glGetQueryObjectiv(frame.queries[p], GL_QUERY_RESULT_AVAILABLE, &available);
+				}
+				if (!available) {
+					return;
+				}
+			}
+			publish(frame, true);
+			nextToPublish++;
+		}
+	}
+
+	void publish(PendingFrame& frame, bool withGpu) {
+		double gpuTotal = NAN;
+		for (int p = 0; p < gpuPassCount; p++) {
+			if (!frame.timed[p] || !withGpu) {
+				frame.values[GpuUpload + p] = NAN;
+				continue;
+			}
+			GLuint64 nanoseconds = 0;
+			glGetQueryObjectui64v(frame.queries[p], GL_QUERY_RESULT, &nanoseconds);
+			frame.values[GpuUpload + p] = nanoseconds / 1.0e6;
+			gpuTotal = (isnan(gpuTotal) ? 0.0 : gpuTotal) + nanoseconds / 1.0e6;
+		}
+		frame.values[GpuTotal] = gpuTotal;
+
+		uint64_t n = written.load(std::memory_order_relaxed);
+		Slot& slot = slots[n % capacity];
+		slot.sequence.store(2 * n + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (int c = 0; c < ColumnCount; c++) {
+			slot.values[c].store(frame.values[c], std::memory_order_relaxed);
+		}
+		slot.sequence.store(2 * n + 2, std::memory_order_release);
+		written.store(n + 1, std::memory_order_release);
+	}
+
+	bool read(uint64_t n, double* out) const {
+		const Slot& slot = slots[n % capacity];
+		uint64_t before = slot.sequence.load(std::memory_order_acquire);
+		if (before != 2 * n + 2) {
+			return false;
+		}
+		for (int c = 0; c < ColumnCount; c++) {
+			out[c] = slot.values[c].load(std::memory_order_relaxed);
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return slot.sequence.load(std::memory_order_relaxed) == before;
+	}
+
+	// Render thread only
+	PendingFrame frames[queueFrames];
+	uint64_t frameNumber = 0;
+	uint64_t nextToPublish = 0;
+	bool active = false;
+	bool gpuActive = false;
+	bool queriesCreated = false;
+	int activePass = -1;
+	Clock::time_point frameStart;
+	Clock::time_point lapStart;
+
+	std::atomic<bool> requestedEnabled{ false };
+	std::unique_ptr<Slot[]> slots;
+	std::atomic<uint64_t> written{ 0 };
+};
@@ -0,0 +1,232 @@
+#pragma once
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HEIGHTBANK_SSE2
+#endif
+
+// Eases a mountain height towards the level set from the audio bands
+class heightPIDController {
+private:
+	double kP = 0.16;
+	double kI = 0.12;
+	double kD = 0.08;
+	double error = 0;
+	double totalError = 0;
+	double lastError = 0;
+	double value = 0;
+	double target = 0;
+
+public:
+	heightPIDController(double initialValue) {
+		value = initialValue;
+	}
+	void setTarget(double a) {
+		target = a;
+	}
+	double getTarget() {
+		return target;
+	}
+	double getValue() {
+		return value;
+	}
+	void step() {
+		error = target - value;
+		totalError += error;
+		double p = kP * error;
+		double i = kI * totalError;
+		double d = kD * (error - lastError);
+		lastError = error;
+		totalError *= 0.8;
+		value += p + i + d;
+	}
+};
+
+// Any number of bands stepped together, stored as one array per field so a step of a larger bank is a
+// single pass two lanes wide. Each band is either the PID controller above with its own gains, or a
+// critically damped spring. The PID gains are per step of referenceTimestep, and step(dt) scales
+// them by dt, so at 60 Hz a band matches heightPIDController exactly and the response keeps its
+// speed at any other tick rate. Long ticks are split so the controller stays stable.
+class HeightControllerBank {
+public:
+	static constexpr double referenceTimestep = 1.0 / 60.0;
+	// Smaller banks step one lane at a time, which measured faster below about eight bands
+	static const int minSimdLanes = 8;
+
+	explicit HeightControllerBank(int bands) : bandCount(bands), laneCount((bands + 1) & ~1) {
+		for (std::vector<double>* field : { &kP, &kI, &kD, &decay, &omega, &springMask, &target, &value,
+			&totalError, &lastError, &velocity, &decayStep, &springStep }) {
+			field->assign(laneCount, 0.0);
+		}
+		for (int band = 0; band < bandCount; band++) {
+			setGains(band, 0.16, 0.12, 0.08, 0.8);
+			omega[band] = 8.0;
+		}
+	}
+
+	int size() const {
+		return bandCount;
+	}
+
+	// decay scales the accumulated error after every reference step
+	void setGains(int band, double p, double i, double d, double integralDecay) {
+		kP[band] = p;
+		kI[band] = i;
+		kD[band] = d;
+		decay[band] = integralDecay;
+		cachedStep = -1.0;
+	}
+
+	// frequency is in radians per second; the spring settles in about 5 / frequency seconds.
+	// Switching modes restarts the band's state from its current value.
+	void setSpring(int band, bool enabled, double frequency) {
+		uint64_t bits = enabled ? ~(uint64_t)0 : 0;
+		if (enabled != (springMask[band] != 0.0)) {
+			springBands += enabled ? 1 : -1;
+		}
+		memcpy(&springMask[band], &bits, sizeof(bits));
+		omega[band] = frequency;
+		totalError[band] = lastError[band] = velocity[band] = 0.0;
+		cachedStep = -1.0;
+	}
+
+	void setTarget(int band, double a) {
+		target[band] = a;
+	}
+
+	double getTarget(int band) const {
+		return target[band];
+	}
+
+	double getValue(int band) const {
+		return value[band];
+	}
+
+	const double* getValues() const {
+		return value.data();
+	}
+
+	void step(double dt) {
+		double steps = dt / referenceTimestep;
+		int substeps = steps > 1.0 ? (int)ceil(steps) : 1;
+		double scale = steps / substeps;
+		if (scale != cachedStep) {
+			for (int band = 0; band < bandCount; band++) {
+				decayStep[band] = pow(decay[band], scale);
+				springStep[band] = exp(-omega[band] * scale * referenceTimestep);
+			}
+			cachedStep = scale;
+		}
+		for (int s = 0; s < substeps; s++) {
+			stepLanes(scale, scale * referenceTimestep);
+		}
+	}
+
+private:
+	// The fields as plain pointers, read once per step. The vectors' own pointers would be
+	// reloaded after every unaligned store, since those may alias anything.
+	struct Lanes {
+		const double *kP, *kI, *kD, *omega, *springMask, *target, *decayStep, *springStep;
+		double *value, *totalError, *lastError, *velocity;
+	};
+
+	// h is the step in reference steps and seconds is the same step in seconds. When the bank
+	// mixes modes, both are computed for every lane and springMask picks one.
+	void stepLanes(double h, double seconds) {
+		const Lanes f = { kP.data(), kI.data(), kD.data(), omega.data(), springMask.data(), target.data(),
+			decayStep.data(), springStep.data(), value.data(), totalError.data(), lastError.data(), velocity.data() };
+#ifdef HEIGHTBANK_SSE2
+		const int lanes = laneCount;
+		if (lanes >= minSimdLanes) {
+			const bool anyPid = springBands < bandCount;
+			const bool anySpring = springBands > 0;
+			const __m128d hs = _mm_set1_pd(h);
+			const __m128d dts = _mm_set1_pd(seconds);
+			if (!anySpring) {
+				for (int l = 0; l < lanes; l += 2) {
+					_mm_storeu_pd(&f.value[l], stepPid(f, l, _mm_loadu_pd(&f.target[l]), _mm_loadu_pd(&f.value[l]), hs));
+				}
+			}
+			else if (!anyPid) {
+				for (int l = 0; l < lanes; l += 2) {
+					_mm_storeu_pd(&f.value[l], stepSpring(f, l, _mm_loadu_pd(&f.target[l]), _mm_loadu_pd(&f.value[l]), dts));
+				}
+			}
+			else {
+				for (int l = 0; l < lanes; l += 2) {
+					__m128d t = _mm_loadu_pd(&f.target[l]);
+					__m128d v = _mm_loadu_pd(&f.value[l]);
+					__m128d mask = _mm_loadu_pd(&f.springMask[l]);
+					__m128d pid = stepPid(f, l, t, v, hs);
+					__m128d spring = stepSpring(f, l, t, v, dts);
+					_mm_storeu_pd(&f.value[l], _mm_or_pd(_mm_and_pd(mask, spring), _mm_andnot_pd(mask, pid)));
+				}
+			}
+			return;
+		}
+#endif
+		// Only the real bands: the spare lane is never read
+		for (int l = 0; l < bandCount; l++) {
+			if (f.springMask[l] != 0.0) {
+				f.value[l] = stepSpring(f, l, seconds);
+			}
+			else {
+				f.value[l] = stepPid(f, l, h);
+			}
+		}
+	}
+
+#ifdef HEIGHTBANK_SSE2
+	static __m128d stepPid(const Lanes& f, int l, __m128d t, __m128d v, __m128d hs) {
+		__m128d error = _mm_sub_pd(t, v);
+		__m128d total = _mm_add_pd(_mm_loadu_pd(&f.totalError[l]), _mm_mul_pd(error, hs));
+		__m128d p = _mm_mul_pd(_mm_mul_pd(_mm_loadu_pd(&f.kP[l]), error), hs);
+		__m128d i = _mm_mul_pd(_mm_mul_pd(_mm_loadu_pd(&f.kI[l]), total), hs);
+		__m128d d = _mm_mul_pd(_mm_loadu_pd(&f.kD[l]), _mm_sub_pd(error, _mm_loadu_pd(&f.lastError[l])));
+		_mm_storeu_pd(&f.lastError[l], error);
+		_mm_storeu_pd(&f.totalError[l], _mm_mul_pd(total, _mm_loadu_pd(&f.decayStep[l])));
+		return _mm_add_pd(v, _mm_add_pd(_mm_add_pd(p, i), d));
+	}
+
+	// The exact solution over the step, so it is stable at any tick rate
+	static __m128d stepSpring(const Lanes& f, int l, __m128d t, __m128d v, __m128d dts) {
+		__m128d w = _mm_loadu_pd(&f.omega[l]);
+		__m128d falloff = _mm_loadu_pd(&f.springStep[l]);
+		__m128d vel = _mm_loadu_pd(&f.velocity[l]);
+		__m128d offset = _mm_sub_pd(v, t);
+		__m128d change = _mm_mul_pd(_mm_add_pd(vel, _mm_mul_pd(w, offset)), dts);
+		_mm_storeu_pd(&f.velocity[l], _mm_mul_pd(_mm_sub_pd(vel, _mm_mul_pd(w, change)), falloff));
+		return _mm_add_pd(t, _mm_mul_pd(_mm_add_pd(offset, change), falloff));
+	}
+#endif
+
+	// The same arithmetic one lane at a time, in the same order so both paths give the same bits
+	static double stepPid(const Lanes& f, int l, double h) {
+		double error = f.target[l] - f.value[l];
+		double total = f.totalError[l] + error * h;
+		double next = f.value[l] + ((f.kP[l] * error * h + f.kI[l] * total * h) + f.kD[l] * (error - f.lastError[l]));
+		f.lastError[l] = error;
+		f.totalError[l] = total * f.decayStep[l];
+		return next;
+	}
+
+	static double stepSpring(const Lanes& f, int l, double seconds) {
+		double offset = f.value[l] - f.target[l];
+		double change = (f.velocity[l] + f.omega[l] * offset) * seconds;
+		f.velocity[l] = (f.velocity[l] - f.omega[l] * change) * f.springStep[l];
+		return f.target[l] + (offset + change) * f.springStep[l];
+	}
+
+	int bandCount;
+	int laneCount; // bandCount rounded up to whole SIMD registers; spare lanes stay at zero
+	int springBands = 0;
+	double cachedStep = -1.0;
+	std::vector<double> kP, kI, kD, decay, omega;
+	std::vector<double> springMask; // all bits set for spring bands
+	std::vector<double> target, value, totalError, lastError, velocity;
+	std::vector<double> decayStep, springStep; // per-band factors for the current step length
+};
@@ -0,0 +1,418 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "Trace.h"
+
+class JobSystem;
+
+// Something a JobSystem thread runs: a graph task or one share of a parallel loop
+struct Job {
+	void (*run)(Job* job) = NULL;
+	const char* name = "";
+};
+
+// Tasks and the tasks each has to wait for. A graph is built, run, waited for and then cleared
+// to build the next one; the task slots are kept, so rebuilding the same graph allocates nothing.
+// Prerequisites are added before the tasks that wait for them, so the order tasks were added in
+// is always a valid order to run them in.
+class TaskGraph {
+public:
+	// Returns the task's id. after lists ids of tasks that have to finish first.
+	int add(const char* name, std::function<void()> work, std::initializer_list<int> after = {}) {
+		if (taskCount == (int)tasks.size()) {
+			tasks.emplace_back(new Task());
+		}
+		int id = taskCount++;
+		Task& task = *tasks[id];
+		task.run = &runTask;
+		task.name = name;
+		task.work = std::move(work);
+		task.graph = this;
+		task.prerequisites = 0;
+		task.dependents.clear();
+		for (int prerequisite : after) {
+			tasks[prerequisite]->dependents.push_back(id);
+			task.prerequisites++;
+		}
+		return id;
+	}
+
+	int size() const {
+		return taskCount;
+	}
+
+	// Queues the tasks that wait for nothing; the rest follow as their prerequisites finish
+	void run(JobSystem& jobs);
+
+	// Runs every task on the calling thread, in the order they were added
+	void runInline() {
+		for (int t = 0; t < taskCount; t++) {
+			execute(*tasks[t]);
+		}
+	}
+
+	// After run(): returns once every task has finished, running queued jobs meanwhile
+	void wait();
+
+	// After run(): returns once the task has finished, so what it wrote can be read while the
+	// rest of the graph is still running
+	void wait(int task);
+
+	void clear() {
+		for (int t = 0; t < taskCount; t++) {
+			tasks[t]->work = nullptr;
+		}
+		taskCount = 0;
+		workNanoseconds = 0;
+	}
+
+	// Time the tasks took, summed over every thread that ran them
+	double getWorkMilliseconds() const {
+		return workNanoseconds.load() / 1.0e6;
+	}
+
+private:
+	struct Task : Job {
+		std::function<void()> work;
+		TaskGraph* graph = NULL;
+		std::vector<int> dependents;
+		int prerequisites = 0;
+		std::atomic<int> waitingFor{ 0 };
+		std::atomic<int> running{ 0 };
+	};
+
+	static void runTask(Job* job);
+
+	void execute(Task& task) {
+		TRACE_SCOPE(task.name);
+		auto start = std::chrono::steady_clock::now();
+		task.work();
+		workNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	std::vector<std::unique_ptr<Task>> tasks;
+	int taskCount = 0;
+	JobSystem* runningOn = NULL;
+	std::atomic<int> unfinished{ 0 };
+	std::atomic<int64_t> workNanoseconds{ 0 };
+};
+
+// Worker threads that run graph tasks and parallel loops. Every worker has its own deque: it
+// pushes and pops jobs at the back, newest first while their data is still in cache, and idle
+// workers steal the oldest job from the front of another's. Threads that are not workers push
+// to a shared deque. A thread waiting for jobs runs queued jobs itself rather than sleeping, so
+// loops and graphs may be nested inside tasks. Jobs must not touch the GL context.
+class JobSystem {
+public:
+	static const int maxThreads = 64;
+
+	// threads is the number of workers: negative for one per core besides the calling thread's,
+	// 0 to run everything on the threads that wait for it. With pinThreads, worker i only runs on
+	// core i + 1, leaving core 0 to the render thread.
+	explicit JobSystem(int threads = -1, bool pinThreads = false) {
+		int cores = std::max(1, (int)std::thread::hardware_concurrency());
+		if (threads < 0) {
+			threads = std::max(1, cores - 1);
+		}
+		threadCount = std::min(threads, maxThreads - 1);
+		queues.reset(new WorkQueue[threadCount + 1]);
+		workers.reserve(threadCount);
+		for (int i = 0; i < threadCount; i++) {
+			workers.emplace_back(&JobSystem::workerLoop, this, i);
+			if (pinThreads) {
+				pin(workers.back(), (i + 1) % cores);
+			}
+		}
+	}
+
+	~JobSystem() {
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+	}
+
+	int getThreadCount() const {
+		return threadCount;
+	}
+
+	// Pieces of one parallelFor() that may run at the same time: one per worker and the caller
+	int getMaxSlots() const {
+		return getThreadCount() + 1;
+	}
+
+	// Calls body(begin, end, slot) over [first, last) in pieces of grain items, on the workers and
+	// the calling thread, and returns when every piece is done. Pieces with the same slot never
+	// run at the same time, so slot can index per-thread scratch of getMaxSlots() entries.
+	template <typename Body>
+	void parallelFor(const char* name, int first, int last, int grain, const Body& body) {
+		grain = std::max(grain, 1);
+		int pieces = last > first ? (last - first + grain - 1) / grain : 0;
+		int helperCount = std::min(pieces - 1, getThreadCount());
+		if (helperCount <= 0) {
+			if (pieces > 0) {
+				TRACE_SCOPE(name);
+				body(first, last, 0);
+			}
+			return;
+		}
+		Loop loop;
+		loop.call = [](const void* context, int begin, int end, int slot) {
+			(*static_cast<const Body*>(context))(begin, end, slot);
+		};
+		loop.body = &body;
+		loop.first = first;
+		loop.last = last;
+		loop.grain = grain;
+		loop.pieces = pieces;
+		loop.unfinishedHelpers = helperCount;
+		LoopHelper helpers[maxThreads];
+		for (int h = 0; h < helperCount; h++) {
+			helpers[h].run = &runLoopHelper;
+			helpers[h].name = name;
+			helpers[h].loop = &loop;
+			helpers[h].system = this;
+			helpers[h].slot = h + 1;
+			push(&helpers[h]);
+		}
+		{
+			TRACE_SCOPE(name);
+			runPieces(loop, 0);
+		}
+		// Helpers that were never picked up are run here and find nothing left
+		helpUntilZero(loop.unfinishedHelpers);
+	}
+
+private:
+	friend class TaskGraph;
+
+	// A deque guarded by its own lock, which only the owner and the odd thief ever take. The ring
+	// grows when full and never shrinks, so steady use allocates nothing.
+	struct WorkQueue {
+		std::mutex mutex;
+		std::vector<Job*> ring = std::vector<Job*>(256);
+		size_t head = 0; // oldest
+		size_t tail = 0; // one past the newest
+
+		void pushBack(Job* job) {
+			std::lock_guard<std::mutex> lock(mutex);
+			if (tail - head == ring.size()) {
+				std::vector<Job*> larger(ring.size() * 2);
+				for (size_t i = head; i < tail; i++) {
+					larger[i % larger.size()] = ring[i % ring.size()];
+				}
+				ring.swap(larger);
+			}
+			ring[tail++ % ring.size()] = job;
+		}
+
+		Job* popBack() {
+			std::lock_guard<std::mutex> lock(mutex);
+			return tail == head ? NULL : ring[--tail % ring.size()];
+		}
+
+		Job* popFront() {
+			std::lock_guard<std::mutex> lock(mutex);
+			return tail == head ? NULL : ring[head++ % ring.size()];
+		}
+	};
+
+	// The body is called through a plain function pointer, so a loop allocates nothing
+	struct Loop {
+		void (*call)(const void* body, int begin, int end, int slot);
+		const void* body;
+		int first;
+		int last;
+		int grain;
+		int pieces;
+		std::atomic<int> nextPiece{ 0 };
+		std::atomic<int> unfinishedHelpers{ 0 };
+	};
+
+	struct LoopHelper : Job {
+		Loop* loop;
+		JobSystem* system;
+		int slot;
+	};
+
+	static void runPieces(Loop& loop, int slot) {
+		for (int piece = loop.nextPiece++; piece < loop.pieces; piece = loop.nextPiece++) {
+			int begin = loop.first + piece * loop.grain;
+			loop.call(loop.body, begin, std::min(begin + loop.grain, loop.last), slot);
+		}
+	}
+
+	static void runLoopHelper(Job* job) {
+		LoopHelper* helper = static_cast<LoopHelper*>(job);
+		JobSystem* system = helper->system;
+		std::atomic<int>& unfinished = helper->loop->unfinishedHelpers;
+		{
+			TRACE_SCOPE(helper->name);
+			runPieces(*helper->loop, helper->slot);
+		}
+		system->countDown(unfinished);
+	}
+
+	static void pin(std::thread& thread, int core) {
+#ifdef _WIN32
+		SetThreadAffinityMask(thread.native_handle(), (DWORD_PTR)1 << (core % (8 * sizeof(DWORD_PTR))));
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(core, &set);
+		pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+		(void)thread;
+		(void)core;
+#endif
+	}
+
+	// The deque of the calling thread: its own for a worker of this system, else the shared one
+	int queueIndex() const {
+		return currentSystem() == this ? currentWorker() : getThreadCount();
+	}
+
+	static const JobSystem*& currentSystem() {
+		thread_local const JobSystem* system = NULL;
+		return system;
+	}
+
+	static int& currentWorker() {
+		thread_local int worker = -1;
+		return worker;
+	}
+
+	void push(Job* job) {
+		queues[queueIndex()].pushBack(job);
+		queued++;
+		{
+			// Orders the count with a sleeper's check of it
+			std::lock_guard<std::mutex> lock(sleepMutex);
+		}
+		wake.notify_one();
+	}
+
+	// Own deque newest first, then the oldest job of every other deque
+	Job* findJob() {
+		int own = queueIndex();
+		int queueCount = getThreadCount() + 1;
+		Job* job = own < getThreadCount() ? queues[own].popBack() : NULL;
+		for (int i = 1; !job && i <= queueCount; i++) {
+			job = queues[(own + i) % queueCount].popFront();
+		}
+		if (job) {
+			queued--;
+		}
+		return job;
+	}
+
+	// Once counter reaches zero its owner may free it, so nothing touches it after that
+	void countDown(std::atomic<int>& counter) {
+		if (counter.fetch_sub(1) == 1) {
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			wake.notify_all();
+		}
+	}
+
+	void helpUntilZero(const std::atomic<int>& counter) {
+		while (counter.load() > 0) {
+			Job* job = findJob();
+			if (job) {
+				job->run(job);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			wake.wait(lock, [&] { return counter.load() == 0 || queued.load() > 0; });
+		}
+	}
+
+	void workerLoop(int index) {
+		TRACE_THREAD_NAME("job worker");
+		currentSystem() = this;
+		currentWorker() = index;
+		while (true) {
+			Job* job = findJob();
+			if (job) {
+				job->run(job);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			wake.wait(lock, [this] { return stopping || queued.load() > 0; });
+			if (stopping) {
+				return;
+			}
+		}
+	}
+
+	int threadCount; // set before the workers start, as they read it
+	std::vector<std::thread> workers;
+	std::unique_ptr<WorkQueue[]> queues; // one per worker, then the shared one
+	std::atomic<int> queued{ 0 };
+	std::mutex sleepMutex;
+	std::condition_variable wake;
+	bool stopping = false;
+};
+
+inline void TaskGraph::runTask(Job* job) {
+	Task* task = static_cast<Task*>(job);
+	TaskGraph* graph = task->graph;
+	JobSystem* jobs = graph->runningOn;
+	graph->execute(*task);
+	for (int dependent : task->dependents) {
+		Task* next = graph->tasks[dependent].get();
+		if (next->waitingFor.fetch_sub(1) == 1) {
+			jobs->push(next);
+		}
+	}
+	jobs->countDown(task->running);
+	jobs->countDown(graph->unfinished);
+}
+
+inline void TaskGraph::run(JobSystem& jobs) {
+	runningOn = &jobs;
+	unfinished = taskCount;
+	for (int t = 0; t < taskCount; t++) {
+		tasks[t]->waitingFor = tasks[t]->prerequisites;
+		tasks[t]->running = 1;
+	}
+	for (int t = 0; t < taskCount; t++) {
+		if (tasks[t]->prerequisites == 0) {
+			jobs.push(tasks[t].get());
+		}
+	}
+}
+
+inline void TaskGraph::wait(int task) {
+	if (runningOn) {
+		runningOn->helpUntilZero(tasks[task]->running);
+	}
+}
+
+inline void TaskGraph::wait() {
+	if (runningOn) {
+		runningOn->helpUntilZero(unfinished);
+		runningOn = NULL;
+	}
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <GL/glew.h>
+
+// On-disk cache of one linked program binary. The key hashes the shader sources together with
+// the driver vendor, renderer and version strings, so a driver update or a shader edit misses.
+// Drivers may still reject a binary they wrote themselves; callers fall back to compiling.
+class ProgramCache {
+public:
+	ProgramCache(const std::string& aPath, const std::vector<std::string>& sources) {
+		path = aPath;
+		key = 14695981039346656037ULL;
+		for (const std::string& source : sources) {
+			hash(source);
+		}
+		hash(glString(GL_VENDOR));
+		hash(glString(GL_RENDERER));
+		hash(glString(GL_VERSION));
+	}
+
+	static bool isSupported() {
+		if (!GLEW_ARB_get_program_binary) {
+			return false;
+		}
+		GLint formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		return formats > 0;
+	}
+
+	// Returns a linked program, or 0 if there is no usable binary for this key
+	GLuint load() {
+		FILE* file = fopen(path.c_str(), "rb");
+		if (file == NULL) {
+			return 0;
+		}
+		Header header;
+		std::vector<char> binary;
+		bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+			header.magic == magic && header.key == key && header.length > 0;
+		if (valid) {
+			binary.resize(header.length);
+			valid = fread(binary.data(), 1, binary.size(), file) == binary.size();
+		}
+		fclose(file);
+		if (!valid) {
+			return 0;
+		}
+
+		GLuint programID = glCreateProgram();
+		glProgramBinary(programID, header.format, binary.data(), (GLsizei)binary.size());
+		GLint linked = GL_FALSE;
+		glGetProgramiv(programID, GL_LINK_STATUS, &linked);
+		if (linked != GL_TRUE) {
+			printf("Cached program binary was rejected by the driver\n");
+			glDeleteProgram(programID);
+			return 0;
+		}
+		return programID;
+	}
+
+	// The program must have been linked with GL_PROGRAM_BINARY_RETRIEVABLE_HINT set
+	void save(GLuint programID) {
+		GLint length = 0;
+		glGetProgramiv(programID, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0) {
+			return;
+		}
+		Header header;
+		header.magic = magic;
+		header.key = key;
+		std::vector<char> binary(length);
+		GLsizei written = 0;
+		glGetProgramBinary(programID, length, &written, &header.format, binary.data());
+		header.length = (uint32_t)written;
+
+		FILE* file = fopen(path.c_str(), "wb");
+		if (file == NULL) {
+			return;
+		}
+		fwrite(&header, sizeof(header), 1, file);
+		fwrite(binary.data(), 1, written, file);
+		fclose(file);
+	}
+
+private:
+	static const uint32_t magic = 0x42504c47; // "GLPB"
+
+	struct Header {
+		uint32_t magic;
+		GLenum format;
+		uint64_t key;
+		uint32_t length;
+		uint32_t reserved = 0;
+	};
+
+	static std::string glString(GLenum name) {
+		const GLubyte* value = glGetString(name);
+		return value != NULL ? std::string((const char*)value) : std::string();
+	}
+
+	// FNV-1a, with a separator so ("ab", "c") and ("a", "bc") differ
+	void hash(const std::string& text) {
+		for (unsigned char c : text) {
+			key = (key ^ c) * 1099511628211ULL;
+		}
+		key = (key ^ 0xff) * 1099511628211ULL;
+	}
+
+	std::string path;
+	uint64_t key;
+};
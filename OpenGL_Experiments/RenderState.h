@@ -0,0 +1,161 @@
+#pragma once
+#include <atomic>
+#include <map>
+#include <GL/glew.h>
+
+// Shadow copy of the GL state the render loop changes. Requests that match the current state are
+// dropped before they reach the driver, and every call that does reach it is counted so the
+// per-frame driver overhead can be read back with getCallsLastFrame().
+class RenderState {
+public:
+	// Call once the context is current
+	void init() {
+		baseInstanceSupported = GLEW_VERSION_4_2 || GLEW_ARB_base_instance;
+	}
+
+	bool hasBaseInstance() const {
+		return baseInstanceSupported;
+	}
+
+	// The tightly packed float per-instance attribute of a vertex array. Without base instances
+	// it is pointed at the first instance of each draw instead.
+	void setInstanceAttribute(GLuint vertexArray, GLuint buffer, GLuint index, GLint components) {
+		InstanceAttribute& attribute = instanceAttributes[vertexArray];
+		attribute.buffer = buffer;
+		attribute.index = index;
+		attribute.components = components;
+		attribute.firstInstance = 0;
+	}
+
+	void beginFrame() {
+		callsLastFrame = callsThisFrame;
+		callsThisFrame = 0;
+	}
+
+	int getCallsLastFrame() const {
+		return callsLastFrame;
+	}
+
+	// For calls that are never redundant (draws, clears, buffer uploads)
+	void countCall(int calls = 1) {
+		callsThisFrame += calls;
+	}
+
+	void setEnabled(GLenum capability, bool enabled) {
+		auto it = capabilities.find(capability);
+		if (it != capabilities.end() && it->second == enabled) {
+			return;
+		}
+		if (enabled) {
+			glEnable(capability);
+		}
+		else {
+			glDisable(capability);
+		}
+		capabilities[capability] = enabled;
+		callsThisFrame++;
+	}
+
+	void polygonMode(GLenum mode) {
+		if (mode != currentPolygonMode) {
+			glPolygonMode(GL_FRONT_AND_BACK, mode);
+			currentPolygonMode = mode;
+			callsThisFrame++;
+		}
+	}
+
+	void polygonOffset(GLfloat factor, GLfloat units) {
+		if (factor != offsetFactor || units != offsetUnits) {
+			glPolygonOffset(factor, units);
+			offsetFactor = factor;
+			offsetUnits = units;
+			callsThisFrame++;
+		}
+	}
+
+	void useProgram(GLuint program) {
+		if (program != currentProgram) {
+			glUseProgram(program);
+			currentProgram = program;
+			callsThisFrame++;
+		}
+	}
+
+	void bindVertexArray(GLuint vertexArray) {
+		if (vertexArray != currentVertexArray) {
+			glBindVertexArray(vertexArray);
+			currentVertexArray = vertexArray;
+			callsThisFrame++;
+		}
+	}
+
+	// Only for targets that are not captured by the vertex array object
+	void bindBuffer(GLenum target, GLuint buffer) {
+		auto it = buffers.find(target);
+		if (it != buffers.end() && it->second == buffer) {
+			return;
+		}
+		glBindBuffer(target, buffer);
+		buffers[target] = buffer;
+		callsThisFrame++;
+	}
+
+	void drawElements(GLenum mode, GLsizei count, GLenum type, const void* offset) {
+		glDrawElements(mode, count, type, offset);
+		callsThisFrame++;
+	}
+
+	void drawArraysInstanced(GLenum mode, GLint first, GLsizei count, GLsizei instanceCount) {
+		pointInstanceAttribute(0);
+		glDrawArraysInstanced(mode, first, count, instanceCount);
+		callsThisFrame++;
+	}
+
+	// Base instances need GL 4.2 or ARB_base_instance; the 3.3 context may have neither
+	void drawElementsInstancedBaseInstance(GLenum mode, GLsizei count, GLenum type, const void* offset, GLsizei instanceCount, GLuint baseInstance) {
+		if (baseInstanceSupported) {
+			glDrawElementsInstancedBaseInstance(mode, count, type, offset, instanceCount, baseInstance);
+		}
+		else {
+			pointInstanceAttribute(baseInstance);
+			glDrawElementsInstanced(mode, count, type, offset, instanceCount);
+		}
+		callsThisFrame++;
+	}
+
+private:
+	struct InstanceAttribute {
+		GLuint buffer = 0;
+		GLuint index = 0;
+		GLint components = 0;
+		GLuint firstInstance = 0; // the instance the attribute pointer starts at
+	};
+
+	void pointInstanceAttribute(GLuint firstInstance) {
+		if (baseInstanceSupported) {
+			return;
+		}
+		auto it = instanceAttributes.find(currentVertexArray);
+		if (it == instanceAttributes.end() || it->second.firstInstance == firstInstance) {
+			return;
+		}
+		InstanceAttribute& attribute = it->second;
+		bindBuffer(GL_ARRAY_BUFFER, attribute.buffer);
+		glVertexAttribPointer(attribute.index, attribute.components, GL_FLOAT, GL_FALSE, 0, (void*)(firstInstance * attribute.components * sizeof(GLfloat)));
+		attribute.firstInstance = firstInstance;
+		callsThisFrame++;
+	}
+
+	bool baseInstanceSupported = false;
+	std::map<GLuint, InstanceAttribute> instanceAttributes;
+	std::map<GLenum, bool> capabilities;
+	std::map<GLenum, GLuint> buffers;
+	GLenum currentPolygonMode = GL_FILL;
+	GLfloat offsetFactor = 0.0f;
+	GLfloat offsetUnits = 0.0f;
+	GLuint currentProgram = 0;
+	GLuint currentVertexArray = 0;
+
+	int callsThisFrame = 0;
+	std::atomic<int> callsLastFrame{ 0 };
+};
@@ -0,0 +1,412 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A session recording holds every parameter update that drives the visualizer (band targets,
+// brightness, and the keys and mouse the camera and colours follow), so the session can be
+// replayed exactly. After a header with the terrain parameters, each event is
+//
+//   varint type, varint microseconds since the previous event, payload
+//
+// Doubles are stored as varints of their bits XORed with the previous value of the same field:
+// slowly changing values share their sign, exponent and top of the mantissa, so the XOR is a
+// small number and its varint short, and nothing is lost.
+
+struct InputState {
+	uint32_t keys = 0; // bit per InputKey held down
+	double cursorX = 0.0; // cursor offset from the window centre, in pixels
+	double cursorY = 0.0;
+
+	bool isDown(int key) const {
+		return (keys & (1u << key)) != 0;
+	}
+};
+
+struct SessionHeader {
+	uint32_t seed = 0;
+	double wavelength = 0.0;
+	int octaves = 0;
+};
+
+struct SessionEvent {
+	enum Type { HeightTargets = 1, Brightness = 2, Input = 3, End = 4 };
+	int type = End;
+	double time = 0.0; // seconds since the recording started
+	double values[3] = {}; // height targets, or brightness in values[0]
+	InputState input;
+};
+
+class SessionFormat {
+public:
+	static const uint32_t magic = 0x53455a56; // "VZES"
+	static const uint32_t version = 1;
+
+	static int putVarint(uint8_t* out, uint64_t value) {
+		int length = 0;
+		while (value >= 0x80) {
+			out[length++] = (uint8_t)(value | 0x80);
+			value >>= 7;
+		}
+		out[length++] = (uint8_t)value;
+		return length;
+	}
+
+	// Returns false at the end of the data or on a varint longer than 64 bits
+	static bool getVarint(const uint8_t*& in, const uint8_t* end, uint64_t& value) {
+		value = 0;
+		for (int shift = 0; shift < 64 && in < end; shift += 7) {
+			uint8_t byte = *in++;
+			value |= (uint64_t)(byte & 0x7f) << shift;
+			if (!(byte & 0x80)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static uint64_t bits(double value) {
+		uint64_t result;
+		memcpy(&result, &value, sizeof(result));
+		return result;
+	}
+
+	static double fromBits(uint64_t value) {
+		double result;
+		memcpy(&result, &value, sizeof(result));
+		return result;
+	}
+
+	// Previous value of every field, shared by the writer and the reader
+	struct Fields {
+		uint64_t heights[3] = {};
+		uint64_t brightness = 0;
+		uint64_t cursor[2] = {};
+	};
+};
+
+// Written from any thread
+class SessionWriter {
+public:
+	~SessionWriter() {
+		close();
+	}
+
+	bool open(const std::string& path, const SessionHeader& header) {
+		std::lock_guard<std::mutex> lock(mutex);
+		closeLocked();
+		file = fopen(path.c_str(), "wb");
+		if (!file) {
+			fprintf(stderr, "Could not open %s for writing\n", path.c_str());
+			return false;
+		}
+		uint8_t buffer[32];
+		int length = 0;
+		length += SessionFormat::putVarint(buffer + length, SessionFormat::magic);
+		length += SessionFormat::putVarint(buffer + length, SessionFormat::version);
+		length += SessionFormat::putVarint(buffer + length, header.seed);
+		length += SessionFormat::putVarint(buffer + length, SessionFormat::bits(header.wavelength));
+		length += SessionFormat::putVarint(buffer + length, (uint64_t)header.octaves);
+		fwrite(buffer, 1, length, file);
+		fields = SessionFormat::Fields();
+		lastInput = InputState();
+		start = lastEvent = Clock::now();
+		events = 0;
+		return true;
+	}
+
+	bool isOpen() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return file != NULL;
+	}
+
+	void recordHeights(double low, double mid, double high) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!file) {
+			return;
+		}
+		uint8_t buffer[64];
+		int length = beginEvent(buffer, SessionEvent::HeightTargets);
+		double values[3] = { low, mid, high };
+		for (int b = 0; b < 3; b++) {
+			uint64_t value = SessionFormat::bits(values[b]);
+			length += SessionFormat::putVarint(buffer + length, value ^ fields.heights[b]);
+			fields.heights[b] = value;
+		}
+		fwrite(buffer, 1, length, file);
+	}
+
+	void recordBrightness(double brightness) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!file) {
+			return;
+		}
+		uint8_t buffer[32];
+		int length = beginEvent(buffer, SessionEvent::Brightness);
+		uint64_t value = SessionFormat::bits(brightness);
+		length += SessionFormat::putVarint(buffer + length, value ^ fields.brightness);
+		fields.brightness = value;
+		fwrite(buffer, 1, length, file);
+	}
+
+	// Render thread, once per frame; only changes are written
+	void recordInput(const InputState& input) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!file || (input.keys == lastInput.keys && input.cursorX == lastInput.cursorX && input.cursorY == lastInput.cursorY)) {
+			return;
+		}
+		lastInput = input;
+		uint8_t buffer[48];
+		int length = beginEvent(buffer, SessionEvent::Input);
+		length += SessionFormat::putVarint(buffer + length, input.keys);
+		double cursor[2] = { input.cursorX, input.cursorY };
+		for (int c = 0; c < 2; c++) {
+			uint64_t value = SessionFormat::bits(cursor[c]);
+			length += SessionFormat::putVarint(buffer + length, value ^ fields.cursor[c]);
+			fields.cursor[c] = value;
+		}
+		fwrite(buffer, 1, length, file);
+	}
+
+	// Marks the end time, so a replay lasts as long as the session did
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closeLocked();
+	}
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	int beginEvent(uint8_t* buffer, int type) {
+		Clock::time_point now = Clock::now();
+		uint64_t microseconds = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now - lastEvent).count();
+		// Keep the rounding from accumulating: the next delta starts where this one ended
+		lastEvent += std::chrono::microseconds(microseconds);
+		events++;
+		int length = SessionFormat::putVarint(buffer, (uint64_t)type);
+		return length + SessionFormat::putVarint(buffer + length, microseconds);
+	}
+
+	void closeLocked() {
+		if (!file) {
+			return;
+		}
+		uint8_t buffer[16];
+		int length = beginEvent(buffer, SessionEvent::End);
+		fwrite(buffer, 1, length, file);
+		long bytes = ftell(file);
+		fclose(file);
+		file = NULL;
+		fprintf(stderr, "Session recording: %llu events in %ld bytes over %.1f s\n", (unsigned long long)events, bytes,
+			std::chrono::duration<double>(lastEvent - start).count());
+	}
+
+	std::mutex mutex;
+	FILE* file = NULL;
+	SessionFormat::Fields fields;
+	InputState lastInput;
+	Clock::time_point start;
+	Clock::time_point lastEvent;
+	uint64_t events = 0;
+};
+
+// Read-only view of a whole file
+class MappedFile {
+public:
+	~MappedFile() {
+		close();
+	}
+
+	bool open(const std::string& path) {
+		close();
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+			close();
+			return false;
+		}
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!mapping) {
+			close();
+			return false;
+		}
+		bytes = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		length = (size_t)fileSize.QuadPart;
+#else
+		descriptor = ::open(path.c_str(), O_RDONLY);
+		if (descriptor < 0) {
+			return false;
+		}
+		struct stat info;
+		if (fstat(descriptor, &info) != 0 || info.st_size == 0) {
+			close();
+			return false;
+		}
+		void* view = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+		bytes = view == MAP_FAILED ? NULL : (const uint8_t*)view;
+		length = (size_t)info.st_size;
+#endif
+		if (!bytes) {
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close() {
+#ifdef _WIN32
+		if (bytes) {
+			UnmapViewOfFile(bytes);
+		}
+		if (mapping) {
+			CloseHandle(mapping);
+		}
+		if (file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file);
+		}
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (bytes) {
+			munmap((void*)bytes, length);
+		}
+		if (descriptor >= 0) {
+			::close(descriptor);
+		}
+		descriptor = -1;
+#endif
+		bytes = NULL;
+		length = 0;
+	}
+
+	const uint8_t* data() const {
+		return bytes;
+	}
+
+	size_t size() const {
+		return length;
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#else
+	int descriptor = -1;
+#endif
+	const uint8_t* bytes = NULL;
+	size_t length = 0;
+};
+
+// Decodes a recording in place from its memory mapping
+class SessionReader {
+public:
+	bool open(const std::string& path) {
+		if (!mapped.open(path)) {
+			fprintf(stderr, "Could not open session recording %s\n", path.c_str());
+			return false;
+		}
+		cursor = mapped.data();
+		end = cursor + mapped.size();
+		uint64_t magic, version, seed, wavelength, octaves;
+		if (!SessionFormat::getVarint(cursor, end, magic) || magic != SessionFormat::magic ||
+			!SessionFormat::getVarint(cursor, end, version) || version != SessionFormat::version ||
+			!SessionFormat::getVarint(cursor, end, seed) || !SessionFormat::getVarint(cursor, end, wavelength) ||
+			!SessionFormat::getVarint(cursor, end, octaves)) {
+			fprintf(stderr, "%s is not a session recording\n", path.c_str());
+			mapped.close();
+			return false;
+		}
+		header.seed = (uint32_t)seed;
+		header.wavelength = SessionFormat::fromBits(wavelength);
+		header.octaves = (int)octaves;
+		fields = SessionFormat::Fields();
+		input = InputState();
+		microseconds = 0;
+		return true;
+	}
+
+	const SessionHeader& getHeader() const {
+		return header;
+	}
+
+	// Returns false after the End event, or where the data is cut short
+	bool next(SessionEvent& event) {
+		uint64_t type, delta;
+		if (!SessionFormat::getVarint(cursor, end, type) || !SessionFormat::getVarint(cursor, end, delta)) {
+			return false;
+		}
+		microseconds += delta;
+		event.type = (int)type;
+		event.time = microseconds / 1.0e6;
+		uint64_t value;
+		switch (type) {
+		case SessionEvent::HeightTargets:
+			for (int b = 0; b < 3; b++) {
+				if (!SessionFormat::getVarint(cursor, end, value)) {
+					return false;
+				}
+				fields.heights[b] ^= value;
+				event.values[b] = SessionFormat::fromBits(fields.heights[b]);
+			}
+			return true;
+		case SessionEvent::Brightness:
+			if (!SessionFormat::getVarint(cursor, end, value)) {
+				return false;
+			}
+			fields.brightness ^= value;
+			event.values[0] = SessionFormat::fromBits(fields.brightness);
+			return true;
+		case SessionEvent::Input:
+			if (!SessionFormat::getVarint(cursor, end, value)) {
+				return false;
+			}
+			input.keys = (uint32_t)value;
+			for (int c = 0; c < 2; c++) {
+				if (!SessionFormat::getVarint(cursor, end, value)) {
+					return false;
+				}
+				fields.cursor[c] ^= value;
+			}
+			input.cursorX = SessionFormat::fromBits(fields.cursor[0]);
+			input.cursorY = SessionFormat::fromBits(fields.cursor[1]);
+			event.input = input;
+			return true;
+		case SessionEvent::End:
+			cursor = end;
+			return true;
+		default:
+			fprintf(stderr, "Unknown event %llu in session recording\n", (unsigned long long)type);
+			cursor = end;
+			return false;
+		}
+	}
+
+private:
+	MappedFile mapped;
+	const uint8_t* cursor = NULL;
+	const uint8_t* end = NULL;
+	SessionHeader header;
+	SessionFormat::Fields fields;
+	InputState input;
+	uint64_t microseconds = 0;
+};
@@ -0,0 +1,122 @@
+#pragma once
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include "RenderState.h"
+
+// Values of the std140 FrameUniforms block declared by the terrain shaders
+struct FrameUniforms {
+	float MVP[16];
+	float color[4]; // rgb tint, w unused
+	float drawCol;
+	float lineCol;
+	float viewportSize[2];
+	float bandAmplitudes[4]; // mLow, mMid, mHi, w unused
+	float depthBias; // subtracted from NDC depth, for lines which polygon offset does not reach
+	float padding[3];
+};
+
+// Wraps a program from LoadShaders() and resolves its FrameUniforms block once
+class ShaderProgram {
+public:
+	static const GLuint frameUniformsBinding = 0;
+
+	bool init(GLuint aProgramID) {
+		programID = aProgramID;
+		GLuint blockIndex = glGetUniformBlockIndex(programID, "FrameUniforms");
+		if (blockIndex == GL_INVALID_INDEX) {
+			fprintf(stderr, "Shader program has no FrameUniforms block\n");
+			return false;
+		}
+		glUniformBlockBinding(programID, blockIndex, frameUniformsBinding);
+		return true;
+	}
+
+	void use(RenderState& state) {
+		state.useProgram(programID);
+	}
+
+	GLuint getProgramID() const {
+		return programID;
+	}
+
+private:
+	GLuint programID = 0;
+};
+
+// Per-pass uniform values live in one uniform buffer with a FrameUniforms copy per pass, so a
+// frame costs one buffer write plus a range bind per pass. Values are compared against the last
+// upload and redundant uploads and binds are skipped.
+class FrameUniformBuffer {
+public:
+	void init(int aPassCount) {
+		passCount = aPassCount;
+
+		GLint alignment = 256;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		passStride = (GLsizeiptr)((sizeof(FrameUniforms) + alignment - 1) / alignment * alignment);
+
+		staging.assign(passStride * passCount, 0);
+		uploaded.assign(passStride * passCount, 0);
+		glGenBuffers(1, &uniformBuffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, uniformBuffer);
+		glBufferData(GL_UNIFORM_BUFFER, passStride * passCount, NULL, GL_DYNAMIC_DRAW);
+		dirty = true;
+		boundPass = -1;
+	}
+
+	void setPass(int pass, const glm::mat4& MVP, const glm::vec3& color, float drawCol, float lineCol, const glm::vec2& viewportSize, const glm::vec3& bandAmplitudes, float depthBias = 0.0f) {
+		FrameUniforms values = {};
+		memcpy(values.MVP, &MVP[0][0], sizeof(values.MVP));
+		values.color[0] = color.r;
+		values.color[1] = color.g;
+		values.color[2] = color.b;
+		values.color[3] = 0.0f;
+		values.drawCol = drawCol;
+		values.lineCol = lineCol;
+		values.viewportSize[0] = viewportSize.x;
+		values.viewportSize[1] = viewportSize.y;
+		values.bandAmplitudes[0] = bandAmplitudes.x;
+		values.bandAmplitudes[1] = bandAmplitudes.y;
+		values.bandAmplitudes[2] = bandAmplitudes.z;
+		values.depthBias = depthBias;
+
+		unsigned char* slot = &staging[pass * passStride];
+		if (memcmp(slot, &values, sizeof(values)) != 0) {
+			memcpy(slot, &values, sizeof(values));
+			dirty = true;
+		}
+	}
+
+	// Uploads changed pass values with a single write
+	void upload(RenderState& state) {
+		if (dirty) {
+			if (memcmp(staging.data(), uploaded.data(), staging.size()) != 0) {
+				state.bindBuffer(GL_UNIFORM_BUFFER, uniformBuffer);
+				glBufferSubData(GL_UNIFORM_BUFFER, 0, staging.size(), staging.data());
+				state.countCall();
+				uploaded = staging;
+			}
+			dirty = false;
+		}
+	}
+
+	void bindPass(RenderState& state, int pass) {
+		if (pass != boundPass) {
+			glBindBufferRange(GL_UNIFORM_BUFFER, ShaderProgram::frameUniformsBinding, uniformBuffer, pass * passStride, sizeof(FrameUniforms));
+			state.countCall();
+			boundPass = pass;
+		}
+	}
+
+private:
+	GLuint uniformBuffer = 0;
+	int passCount = 0;
+	GLsizeiptr passStride = 0;
+	std::vector<unsigned char> staging;
+	std::vector<unsigned char> uploaded;
+	bool dirty = false;
+	int boundPass = -1;
+};
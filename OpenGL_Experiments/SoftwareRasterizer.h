@@ -0,0 +1,436 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "JobSystem.h"
+
+// CPU renderer that reproduces the OpenGL terrain look without a GL driver: a filled pass at
+// brightness, then a wireframe pass at brightness + 0.4 with polygon offset (-1, -1), additive
+// GL_SRC_ALPHA, GL_ONE blending and GL_LESS depth testing. Primitives are binned into screen
+// tiles and tiles are rasterized in parallel on jobs, each keeping submission order so the
+// blended result matches a GL draw. Rows are stored bottom-up like glReadPixels. Multisampling is not emulated.
+class SoftwareRasterizer {
+public:
+	struct Shading {
+		float brightness;
+		float r;
+		float g;
+		float b;
+	};
+
+	explicit SoftwareRasterizer(JobSystem& aJobs) : jobs(aJobs) {}
+
+	void resize(int aWidth, int aHeight) {
+		if (aWidth == width && aHeight == height) {
+			return;
+		}
+		width = aWidth;
+		height = aHeight;
+		tilesX = (width + tileSize - 1) / tileSize;
+		tilesY = (height + tileSize - 1) / tileSize;
+		color.assign((size_t)width * height * 4, 0.0f);
+		depth.assign((size_t)width * height, 1.0f);
+		pixels.assign((size_t)width * height * 4, 0);
+		triangleBins.assign(tilesX * tilesY, std::vector<uint32_t>());
+		lineBins.assign(tilesX * tilesY, std::vector<uint32_t>());
+	}
+
+	void setClearColor(float r, float g, float b, float a) {
+		clearColor = glm::vec4(r, g, b, a);
+	}
+
+	// With entries > 0, vertices are transformed as the index list reaches them through a FIFO
+	// post-transform cache of that size, like a GPU vertex stage, instead of all up front. This
+	// makes the cost of the vertex stage depend on index order, for benchmarking it.
+	void setVertexCacheSize(int entries) {
+		vertexCacheSize = entries;
+	}
+
+	int getVertexTransformsLastFrame() const {
+		return vertexTransforms;
+	}
+
+	// positions are xyz triples as uploaded to the GL vertex buffer
+	void render(const float* positions, int vertexCount, const unsigned short* indices, int indexCount, const glm::mat4& mvp, const Shading& shading) {
+		fillShading = shading;
+		lineShading = shading;
+		lineShading.brightness += 0.4f;
+
+		if (vertexCacheSize <= 0) {
+			transformed.resize(vertexCount);
+			for (int i = 0; i < vertexCount; i++) {
+				transformed[i] = transform(positions, i, mvp);
+			}
+			vertexTransforms = vertexCount;
+		}
+
+		triangles.clear();
+		lines.clear();
+		for (std::vector<uint32_t>& bin : triangleBins) {
+			bin.clear();
+		}
+		for (std::vector<uint32_t>& bin : lineBins) {
+			bin.clear();
+		}
+		if (vertexCacheSize <= 0) {
+			for (int i = 0; i + 2 < indexCount; i += 3) {
+				setupTriangle(transformed[indices[i]], transformed[indices[i + 1]], transformed[indices[i + 2]]);
+			}
+		}
+		else {
+			cacheTags.assign(vertexCacheSize, -1);
+			cacheEntries.resize(vertexCacheSize);
+			int next = 0;
+			vertexTransforms = 0;
+			for (int i = 0; i + 2 < indexCount; i += 3) {
+				ClipVertex corners[3];
+				for (int c = 0; c < 3; c++) {
+					int v = indices[i + c];
+					int slot = (int)(std::find(cacheTags.begin(), cacheTags.end(), v) - cacheTags.begin());
+					if (slot == vertexCacheSize) {
+						slot = next;
+						next = (next + 1) % vertexCacheSize;
+						cacheTags[slot] = v;
+						cacheEntries[slot] = transform(positions, v, mvp);
+						vertexTransforms++;
+					}
+					corners[c] = cacheEntries[slot];
+				}
+				setupTriangle(corners[0], corners[1], corners[2]);
+			}
+		}
+
+		jobs.parallelFor("software tiles", 0, tilesX * tilesY, 1, [this](int begin, int end, int) {
+			for (int tile = begin; tile < end; tile++) {
+				rasterizeTile(tile);
+			}
+		});
+	}
+
+	// RGBA8, bottom row first
+	const std::vector<uint8_t>& getPixels() const {
+		return pixels;
+	}
+
+	int getWidth() const {
+		return width;
+	}
+
+	int getHeight() const {
+		return height;
+	}
+
+	bool writeImage(const std::string& path) const {
+		FILE* file = fopen(path.c_str(), "wb");
+		if (file == NULL) {
+			fprintf(stderr, "Failed to open %s\n", path.c_str());
+			return false;
+		}
+		fprintf(file, "P6\n%d %d\n255\n", width, height);
+		std::vector<uint8_t> row(width * 3);
+		for (int y = height - 1; y >= 0; y--) {
+			for (int x = 0; x < width; x++) {
+				const uint8_t* p = &pixels[((size_t)y * width + x) * 4];
+				row[x * 3] = p[0];
+				row[x * 3 + 1] = p[1];
+				row[x * 3 + 2] = p[2];
+			}
+			fwrite(row.data(), 1, row.size(), file);
+		}
+		fclose(file);
+		return true;
+	}
+
+private:
+	static const int tileSize = 64;
+
+	struct ClipVertex {
+		glm::vec4 clip;
+		float zPos;
+	};
+
+	struct ScreenVertex {
+		float x, y, z;
+		float invW;
+		float zPosOverW;
+	};
+
+	struct Triangle {
+		ScreenVertex v[3];
+		float invArea;
+	};
+
+	struct Line {
+		ScreenVertex a, b;
+		float depthOffset;
+	};
+
+	static ScreenVertex toScreen(const ClipVertex& v, int width, int height) {
+		ScreenVertex s;
+		s.invW = 1.0f / v.clip.w;
+		s.x = (v.clip.x * s.invW * 0.5f + 0.5f) * width;
+		s.y = (v.clip.y * s.invW * 0.5f + 0.5f) * height;
+		s.z = v.clip.z * s.invW * 0.5f + 0.5f;
+		s.zPosOverW = v.zPos * s.invW;
+		return s;
+	}
+
+	static float edge(const ScreenVertex& a, const ScreenVertex& b, float x, float y) {
+		return (b.x - a.x) * (y - a.y) - (b.y - a.y) * (x - a.x);
+	}
+
+	// Top-left fill rule for counter-clockwise triangles, so shared edges are only covered once
+	static bool isTopLeft(const ScreenVertex& a, const ScreenVertex& b) {
+		return (a.y == b.y && b.x < a.x) || b.y < a.y;
+	}
+
+	// Converts a screen coordinate to a pixel index, clamped so far off-screen vertices cannot overflow
+	static int toPixel(float value, int low, int high) {
+		return (int)std::floor(glm::clamp(value, (float)low, (float)high));
+	}
+
+	void binPrimitive(std::vector<std::vector<uint32_t>>& bins, uint32_t id, float minX, float maxX, float minY, float maxY) {
+		if (maxX < 0 || maxY < 0 || minX >= width || minY >= height) {
+			return;
+		}
+		int tx0 = toPixel(minX, 0, width - 1) / tileSize;
+		int tx1 = toPixel(maxX, 0, width - 1) / tileSize;
+		int ty0 = toPixel(minY, 0, height - 1) / tileSize;
+		int ty1 = toPixel(maxY, 0, height - 1) / tileSize;
+		for (int ty = ty0; ty <= ty1; ty++) {
+			for (int tx = tx0; tx <= tx1; tx++) {
+				bins[ty * tilesX + tx].push_back(id);
+			}
+		}
+	}
+
+	static ClipVertex transform(const float* positions, int index, const glm::mat4& mvp) {
+		const float* p = positions + index * 3;
+		ClipVertex vertex;
+		vertex.clip = mvp * glm::vec4(p[0], p[1], p[2], 1.0f);
+		vertex.zPos = p[1];
+		return vertex;
+	}
+
+	void setupTriangle(const ClipVertex& a, const ClipVertex& b, const ClipVertex& c) {
+		// Clip against the near plane (z > -w); the result is a convex polygon of up to 4 vertices
+		const ClipVertex input[3] = { a, b, c };
+		ClipVertex polygon[4];
+		int count = 0;
+		for (int i = 0; i < 3; i++) {
+			const ClipVertex& p = input[i];
+			const ClipVertex& q = input[(i + 1) % 3];
+			float dp = p.clip.z + p.clip.w;
+			float dq = q.clip.z + q.clip.w;
+			if (dp >= 0) {
+				polygon[count++] = p;
+			}
+			if ((dp >= 0) != (dq >= 0)) {
+				float t = dp / (dp - dq);
+				polygon[count].clip = p.clip + (q.clip - p.clip) * t;
+				polygon[count].zPos = p.zPos + (q.zPos - p.zPos) * t;
+				count++;
+			}
+		}
+		if (count < 3) {
+			return;
+		}
+
+		ScreenVertex screen[4];
+		for (int i = 0; i < count; i++) {
+			screen[i] = toScreen(polygon[i], width, height);
+		}
+
+		// glPolygonOffset(-1, -1): pull lines towards the camera by the max depth slope plus one unit
+		float depthOffset = 0;
+		for (int i = 1; i + 1 < count; i++) {
+			Triangle triangle;
+			triangle.v[0] = screen[0];
+			triangle.v[1] = screen[i];
+			triangle.v[2] = screen[i + 1];
+			float area = edge(triangle.v[0], triangle.v[1], triangle.v[2].x, triangle.v[2].y);
+			if (area == 0) {
+				continue;
+			}
+			if (area < 0) {
+				std::swap(triangle.v[1], triangle.v[2]);
+				area = -area;
+			}
+			triangle.invArea = 1.0f / area;
+
+			const ScreenVertex* v = triangle.v;
+			float dzdx = ((v[1].z - v[0].z) * (v[2].y - v[0].y) - (v[2].z - v[0].z) * (v[1].y - v[0].y)) * triangle.invArea;
+			float dzdy = ((v[2].z - v[0].z) * (v[1].x - v[0].x) - (v[1].z - v[0].z) * (v[2].x - v[0].x)) * triangle.invArea;
+			depthOffset = std::max(depthOffset, std::max(std::abs(dzdx), std::abs(dzdy)));
+
+			float minX = std::min({ v[0].x, v[1].x, v[2].x });
+			float maxX = std::max({ v[0].x, v[1].x, v[2].x });
+			float minY = std::min({ v[0].y, v[1].y, v[2].y });
+			float maxY = std::max({ v[0].y, v[1].y, v[2].y });
+			binPrimitive(triangleBins, (uint32_t)triangles.size(), minX, maxX, minY, maxY);
+			triangles.push_back(triangle);
+		}
+		depthOffset += 1.0f / (1 << 24);
+
+		for (int i = 0; i < count; i++) {
+			Line line;
+			line.a = screen[i];
+			line.b = screen[(i + 1) % count];
+			line.depthOffset = depthOffset;
+			binPrimitive(lineBins, (uint32_t)lines.size(),
+				std::min(line.a.x, line.b.x) - 1, std::max(line.a.x, line.b.x) + 1,
+				std::min(line.a.y, line.b.y) - 1, std::max(line.a.y, line.b.y) + 1);
+			lines.push_back(line);
+		}
+	}
+
+	inline void shadeFragment(int x, int y, float z, float zPos, const Shading& shading) {
+		size_t pixel = (size_t)y * width + x;
+		if (z < 0 || z > 1 || !(z < depth[pixel])) {
+			return;
+		}
+		depth[pixel] = z;
+
+		float colAmount = shading.brightness + 0.13f * zPos;
+		float srcR = glm::clamp(colAmount * shading.r, 0.0f, 1.0f);
+		float srcG = glm::clamp(colAmount * shading.g, 0.0f, 1.0f);
+		float srcB = glm::clamp(colAmount * shading.b, 0.0f, 1.0f);
+		float srcA = glm::clamp(colAmount * 1.5f, 0.0f, 1.0f);
+		float* dst = &color[pixel * 4];
+		dst[0] = std::min(dst[0] + srcR * srcA, 1.0f);
+		dst[1] = std::min(dst[1] + srcG * srcA, 1.0f);
+		dst[2] = std::min(dst[2] + srcB * srcA, 1.0f);
+		dst[3] = std::min(dst[3] + srcA * srcA, 1.0f);
+	}
+
+	void rasterizeTriangle(const Triangle& triangle, int x0, int y0, int x1, int y1) {
+		const ScreenVertex* v = triangle.v;
+		int minX = toPixel(std::min({ v[0].x, v[1].x, v[2].x }), x0, x1);
+		int maxX = toPixel(std::max({ v[0].x, v[1].x, v[2].x }) + 1, x0, x1);
+		int minY = toPixel(std::min({ v[0].y, v[1].y, v[2].y }), y0, y1);
+		int maxY = toPixel(std::max({ v[0].y, v[1].y, v[2].y }) + 1, y0, y1);
+		bool topLeft0 = isTopLeft(v[1], v[2]);
+		bool topLeft1 = isTopLeft(v[2], v[0]);
+		bool topLeft2 = isTopLeft(v[0], v[1]);
+
+		for (int y = minY; y < maxY; y++) {
+			float py = y + 0.5f;
+			for (int x = minX; x < maxX; x++) {
+				float px = x + 0.5f;
+				float w0 = edge(v[1], v[2], px, py);
+				float w1 = edge(v[2], v[0], px, py);
+				float w2 = edge(v[0], v[1], px, py);
+				if (w0 < 0 || w1 < 0 || w2 < 0 || (w0 == 0 && !topLeft0) || (w1 == 0 && !topLeft1) || (w2 == 0 && !topLeft2)) {
+					continue;
+				}
+				w0 *= triangle.invArea;
+				w1 *= triangle.invArea;
+				w2 *= triangle.invArea;
+				float z = w0 * v[0].z + w1 * v[1].z + w2 * v[2].z;
+				float invW = w0 * v[0].invW + w1 * v[1].invW + w2 * v[2].invW;
+				float zPos = (w0 * v[0].zPosOverW + w1 * v[1].zPosOverW + w2 * v[2].zPosOverW) / invW;
+				shadeFragment(x, y, z, zPos, fillShading);
+			}
+		}
+	}
+
+	// Non-antialiased wide line (glLineWidth(2)): a span two pixels across the minor axis
+	void rasterizeLine(const Line& line, int x0, int y0, int x1, int y1) {
+		const ScreenVertex& a = line.a;
+		const ScreenVertex& b = line.b;
+		float dx = b.x - a.x;
+		float dy = b.y - a.y;
+		bool xMajor = std::abs(dx) >= std::abs(dy);
+		float length = xMajor ? dx : dy;
+		if (length == 0) {
+			return;
+		}
+		float start = xMajor ? a.x : a.y;
+		float from = std::min(a.x, b.x);
+		float to = std::max(a.x, b.x);
+		if (!xMajor) {
+			from = std::min(a.y, b.y);
+			to = std::max(a.y, b.y);
+		}
+		int majorLow = xMajor ? x0 : y0;
+		int majorHigh = xMajor ? x1 : y1;
+		int majorBegin = -toPixel(0.5f - from, -majorHigh, -majorLow);
+		int majorEnd = -toPixel(0.5f - to, -majorHigh, -majorLow);
+		for (int major = majorBegin; major < majorEnd; major++) {
+			float t = (major + 0.5f - start) / length;
+			float minorCenter = xMajor ? a.y + dy * t : a.x + dx * t;
+			int minorBegin = (int)std::ceil(minorCenter - 1.0f - 0.5f);
+			for (int minor = minorBegin; minor < minorBegin + 2; minor++) {
+				int x = xMajor ? major : minor;
+				int y = xMajor ? minor : major;
+				if (x < x0 || x >= x1 || y < y0 || y >= y1) {
+					continue;
+				}
+				float z = a.z + (b.z - a.z) * t - line.depthOffset;
+				float invW = a.invW + (b.invW - a.invW) * t;
+				float zPos = (a.zPosOverW + (b.zPosOverW - a.zPosOverW) * t) / invW;
+				shadeFragment(x, y, z, zPos, lineShading);
+			}
+		}
+	}
+
+	void rasterizeTile(int tile) {
+		int x0 = (tile % tilesX) * tileSize;
+		int y0 = (tile / tilesX) * tileSize;
+		int x1 = std::min(x0 + tileSize, width);
+		int y1 = std::min(y0 + tileSize, height);
+
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				size_t pixel = (size_t)y * width + x;
+				color[pixel * 4] = clearColor.r;
+				color[pixel * 4 + 1] = clearColor.g;
+				color[pixel * 4 + 2] = clearColor.b;
+				color[pixel * 4 + 3] = clearColor.a;
+				depth[pixel] = 1.0f;
+			}
+		}
+
+		for (uint32_t id : triangleBins[tile]) {
+			rasterizeTriangle(triangles[id], x0, y0, x1, y1);
+		}
+		for (uint32_t id : lineBins[tile]) {
+			rasterizeLine(lines[id], x0, y0, x1, y1);
+		}
+
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				size_t pixel = (size_t)y * width + x;
+				for (int c = 0; c < 4; c++) {
+					pixels[pixel * 4 + c] = (uint8_t)(color[pixel * 4 + c] * 255.0f + 0.5f);
+				}
+			}
+		}
+	}
+
+	int width = 0;
+	int height = 0;
+	int tilesX = 0;
+	int tilesY = 0;
+	glm::vec4 clearColor = glm::vec4(0.0f);
+	Shading fillShading;
+	Shading lineShading;
+
+	std::vector<ClipVertex> transformed;
+	int vertexCacheSize = 0;
+	std::vector<int> cacheTags;
+	std::vector<ClipVertex> cacheEntries;
+	int vertexTransforms = 0;
+	std::vector<Triangle> triangles;
+	std::vector<Line> lines;
+	std::vector<std::vector<uint32_t>> triangleBins;
+	std::vector<std::vector<uint32_t>> lineBins;
+	std::vector<float> color;
+	std::vector<float> depth;
+	std::vector<uint8_t> pixels;
+
+	JobSystem& jobs;
+};
@@ -0,0 +1,81 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+#include <PerlinNoise.hpp>
+
+// CPU terrain building blocks, shared by the visualizer and the benchmarks
+
+// Each band's value from an octaveNoise0_1 sample. All three rise with the sample.
+inline double lowBandNoise(double sample) {
+	return std::max(sample * 10 - 4, 0.0) * 1.5;
+}
+
+inline double midBandNoise(double sample) {
+	return sample * 5.0 - 3.0;
+}
+
+inline double highBandNoise(double sample) {
+	return sample * 4.0 - 1.0;
+}
+
+// octaveNoise0_1 overshoots [0, 1] slightly; these bound it
+const double noiseSampleMin = -0.1;
+const double noiseSampleMax = 1.1;
+
+// Smallest and largest value of each band for any sample
+inline void bandNoiseBounds(float bounds[3][2]) {
+	double (*bands[3])(double) = { lowBandNoise, midBandNoise, highBandNoise };
+	for (int b = 0; b < 3; b++) {
+		bounds[b][0] = (float)bands[b](noiseSampleMin);
+		bounds[b][1] = (float)bands[b](noiseSampleMax);
+	}
+}
+
+// Fills rows [firstRow, endRow) of the three noise bands of a gridSize x gridSize chunk whose
+// first row is noiseRow. The compute shader in Application.cpp must produce the same values.
+inline void generateBandNoiseRows(const siv::PerlinNoise& perlin, double wavelength, double noiseRow, int gridSize, int firstRow, int endRow, float* noise1, float* noise2, float* noise3) {
+	for (int i = firstRow; i < endRow; i++) {
+		for (int j = 0; j < gridSize; j++) {
+			int index = j + i * gridSize;
+			noise1[index] = lowBandNoise(perlin.octaveNoise0_1((i + noiseRow) / wavelength, j / wavelength, 1));
+			noise2[index] = midBandNoise(perlin.octaveNoise0_1((i + noiseRow) / (wavelength / 2), j / (wavelength / 2), 1));
+			noise3[index] = highBandNoise(perlin.octaveNoise0_1((i + noiseRow) / (wavelength / 4), j / (wavelength / 4), 1));
+		}
+	}
+}
+
+inline void generateBandNoise(const siv::PerlinNoise& perlin, double wavelength, double noiseRow, int gridSize, float* noise1, float* noise2, float* noise3) {
+	generateBandNoiseRows(perlin, wavelength, noiseRow, gridSize, 0, gridSize, noise1, noise2, noise3);
+}
+
+// Height of a vertex from its column's peak profile and the band amplitudes
+inline double compositeHeight(double peak, double low, double mid, double high, float noise1, float noise2, float noise3) {
+	return peak * (low * noise1 + mid * noise2 + high * noise3);
+}
+
+inline int gridIndexCount(int gridSize) {
+	return (gridSize - 1) * (gridSize - 1) * 6;
+}
+
+// Two triangles per grid cell, row by row, for a chunk whose first vertex is firstVertex.
+// Writes gridIndexCount(gridSize) indices and returns the end of them.
+inline unsigned short* writeGridIndices(int gridSize, int firstVertex, unsigned short* out) {
+	for (int j = 0; j < gridSize - 1; j++) {
+		for (int i = 0; i < gridSize - 1; i++) {
+			int index = i + gridSize * j + firstVertex;
+			*out++ = index;
+			*out++ = index + 1;
+			*out++ = index + gridSize;
+			*out++ = index + 1;
+			*out++ = index + gridSize;
+			*out++ = index + gridSize + 1;
+		}
+	}
+	return out;
+}
+
+inline void appendGridIndices(int gridSize, int firstVertex, std::vector<unsigned short>& indices) {
+	size_t first = indices.size();
+	indices.resize(first + gridIndexCount(gridSize));
+	writeGridIndices(gridSize, firstVertex, &indices[first]);
+}
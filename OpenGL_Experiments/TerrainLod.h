@@ -0,0 +1,190 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <unordered_set>
+#include <vector>
+#include <GL/glew.h>
+#include "VertexCacheOptimizer.h"
+
+// Index lists for drawing one gridSize x gridSize chunk at reduced density. Level l keeps every
+// 2^l-th row and column plus the last one. The first and last rows are shared with the
+// neighbouring chunks, so each of those rows may be sampled at a coarser level than the rest of
+// the chunk; both chunks on a boundary draw it at the coarser of their two levels, which keeps
+// the seam free of cracks. Every (level, front edge level, back edge level) combination is
+// precomputed, with triangles and unique edge lines, and indices are relative to the chunk's
+// first vertex (vertex = column + row * gridSize).
+class ChunkLodSet {
+public:
+	static const int levels = 4;
+	// Triangles are reordered for the vertex cache within bands of this many strips. The fill is
+	// additive with a depth test, so it relies on rows being drawn near to far; reordering whole
+	// chunks lets hills show through each other.
+	static const int optimizeStrips = 2;
+
+	struct Range {
+		GLsizei firstTriangleIndex;
+		GLsizei triangleIndexCount;
+		GLsizei firstLineIndex;
+		GLsizei lineIndexCount;
+	};
+
+	void build(int aGridSize) {
+		gridSize = aGridSize;
+		std::vector<unsigned short> triangles;
+		std::vector<std::vector<unsigned short>> lines(variantCount);
+		for (int lod = 0; lod < levels; lod++) {
+			for (int front = lod; front < levels; front++) {
+				for (int back = lod; back < levels; back++) {
+					Range& range = ranges[variant(lod, front, back)];
+					range.firstTriangleIndex = (GLsizei)triangles.size();
+					std::vector<size_t> strips;
+					appendTriangles(lod, front, back, triangles, strips);
+					range.triangleIndexCount = (GLsizei)triangles.size() - range.firstTriangleIndex;
+					unsigned short* variantIndices = &triangles[range.firstTriangleIndex];
+					if (lod == 0 && front == 0 && back == 0) {
+						acmrBefore = VertexCacheOptimizer::computeAcmr(variantIndices, range.triangleIndexCount);
+					}
+					// Reorder within bands of strips so the chunk is still drawn front to back
+					for (size_t s = 0; s + 1 < strips.size(); s += optimizeStrips) {
+						size_t end = strips[std::min(s + optimizeStrips, strips.size() - 1)];
+						VertexCacheOptimizer::optimize(&triangles[strips[s]], (int)(end - strips[s]), gridSize * gridSize);
+					}
+					if (lod == 0 && front == 0 && back == 0) {
+						acmrAfter = VertexCacheOptimizer::computeAcmr(variantIndices, range.triangleIndexCount);
+					}
+					appendUniqueEdges(&triangles[range.firstTriangleIndex], range.triangleIndexCount, lines[variant(lod, front, back)]);
+				}
+			}
+		}
+
+		// Line lists follow all the triangle lists
+		indices = triangles;
+		for (int lod = 0; lod < levels; lod++) {
+			for (int front = lod; front < levels; front++) {
+				for (int back = lod; back < levels; back++) {
+					Range& range = ranges[variant(lod, front, back)];
+					range.firstLineIndex = (GLsizei)indices.size();
+					range.lineIndexCount = (GLsizei)lines[variant(lod, front, back)].size();
+					indices.insert(indices.end(), lines[variant(lod, front, back)].begin(), lines[variant(lod, front, back)].end());
+				}
+			}
+		}
+	}
+
+	// Edge levels must not be finer than the chunk level
+	const Range& getRange(int lod, int frontLod, int backLod) const {
+		return ranges[variant(lod, frontLod, backLod)];
+	}
+
+	const std::vector<unsigned short>& getIndices() const {
+		return indices;
+	}
+
+	// ACMR of the full density triangles in row order and after reordering
+	double getAcmrBefore() const {
+		return acmrBefore;
+	}
+
+	double getAcmrAfter() const {
+		return acmrAfter;
+	}
+
+	// Rows (or columns) kept at a level: 0, s, 2s, ... and the last one
+	static std::vector<int> samples(int gridSize, int lod) {
+		int step = 1 << lod;
+		std::vector<int> kept;
+		for (int i = 0; i < gridSize - 1; i += step) {
+			kept.push_back(i);
+		}
+		kept.push_back(gridSize - 1);
+		return kept;
+	}
+
+	// Largest value range inside one cell of a level. Dropped vertices are replaced by values
+	// interpolated from the cell corners, so this bounds the error of drawing the level. Walks
+	// the same cells as samples() without building it, as it runs for every chunk loaded.
+	static float maxCellRange(const float* values, int gridSize, int lod) {
+		int step = 1 << lod;
+		float range = 0.0f;
+		for (int top = 0; top < gridSize - 1; top += step) {
+			int bottom = std::min(top + step, gridSize - 1);
+			for (int left = 0; left < gridSize - 1; left += step) {
+				int right = std::min(left + step, gridSize - 1);
+				float low = values[left + top * gridSize];
+				float high = low;
+				for (int row = top; row <= bottom; row++) {
+					for (int column = left; column <= right; column++) {
+						low = std::min(low, values[column + row * gridSize]);
+						high = std::max(high, values[column + row * gridSize]);
+					}
+				}
+				range = std::max(range, high - low);
+			}
+		}
+		return range;
+	}
+
+private:
+	static const int variantCount = levels * levels * levels;
+
+	static int variant(int lod, int front, int back) {
+		return lod + levels * (front + levels * back);
+	}
+
+	// Also records where each strip between two kept rows starts, followed by the end
+	void appendTriangles(int lod, int frontLod, int backLod, std::vector<unsigned short>& out, std::vector<size_t>& strips) const {
+		std::vector<int> rows = samples(gridSize, lod);
+		for (size_t r = 0; r + 1 < rows.size(); r++) {
+			strips.push_back(out.size());
+			int topLod = r == 0 ? frontLod : lod;
+			int bottomLod = r + 2 == rows.size() ? backLod : lod;
+			zipRows(rows[r], samples(gridSize, topLod), rows[r + 1], samples(gridSize, bottomLod), out);
+		}
+		strips.push_back(out.size());
+	}
+
+	// Triangulates the strip between two rows that may keep different columns. With equal
+	// columns this gives the full density pattern: (i, i + 1, i + n) then (i + 1, i + n, i + n + 1).
+	void zipRows(int topRow, const std::vector<int>& top, int bottomRow, const std::vector<int>& bottom, std::vector<unsigned short>& out) const {
+		size_t t = 0;
+		size_t b = 0;
+		while (t + 1 < top.size() || b + 1 < bottom.size()) {
+			bool advanceTop = b + 1 == bottom.size() || (t + 1 < top.size() && top[t + 1] <= bottom[b + 1]);
+			if (advanceTop) {
+				out.push_back(top[t] + topRow * gridSize);
+				out.push_back(top[t + 1] + topRow * gridSize);
+				out.push_back(bottom[b] + bottomRow * gridSize);
+				t++;
+			}
+			else {
+				out.push_back(top[t] + topRow * gridSize);
+				out.push_back(bottom[b] + bottomRow * gridSize);
+				out.push_back(bottom[b + 1] + bottomRow * gridSize);
+				b++;
+			}
+		}
+	}
+
+	// Each edge of a triangle list once, in the order it is first used. Interior edges are
+	// shared by two triangles, so this is about half the segments of drawing with GL_LINE.
+	static void appendUniqueEdges(const unsigned short* triangles, GLsizei count, std::vector<unsigned short>& out) {
+		std::unordered_set<uint32_t> edges;
+		for (GLsizei t = 0; t < count; t += 3) {
+			for (int e = 0; e < 3; e++) {
+				unsigned short a = triangles[t + e];
+				unsigned short b = triangles[t + (e + 1) % 3];
+				uint32_t key = a < b ? (uint32_t)a << 16 | b : (uint32_t)b << 16 | a;
+				if (edges.insert(key).second) {
+					out.push_back(a);
+					out.push_back(b);
+				}
+			}
+		}
+	}
+
+	int gridSize = 0;
+	Range ranges[variantCount] = {};
+	std::vector<unsigned short> indices;
+	double acmrBefore = 0.0;
+	double acmrAfter = 0.0;
+};
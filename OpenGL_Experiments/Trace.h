@@ -0,0 +1,212 @@
+#pragma once
+// Chrome trace events (chrome://tracing or ui.perfetto.dev) from zones on any thread. Tracing
+// is compiled in only with VISUALIZER_TRACE defined; otherwise the macros expand to nothing.
+//
+//   TRACE_SCOPE("name")            zone until the end of the enclosing block
+//   TRACE_BEGIN("name"), TRACE_END("name")
+//   TRACE_FLOW_START("name", id)   arrow from the enclosing zone ...
+//   TRACE_FLOW_END("name", id)     ... to the enclosing zone on another thread
+//   TRACE_THREAD_NAME("name")
+//
+// Names must be string literals. Each thread appends to its own fixed buffer, so recording takes
+// no lock: the owning thread writes an event, then publishes the new count, and the exporter
+// reads only up to the published count.
+
+#ifdef VISUALIZER_TRACE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class Trace {
+public:
+	static const uint32_t eventsPerThread = 1 << 17; // about 100 s of frames on the render thread
+
+	// Drops anything recorded before. The trace goes to path on stopAndWrite().
+	static void start(const std::string& path) {
+		State& state = getState();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		state.path = path;
+		state.epoch = Clock::now();
+		state.session++;
+		state.recording = true;
+	}
+
+	static bool isRecording() {
+		return getState().recording.load(std::memory_order_relaxed);
+	}
+
+	static bool stopAndWrite() {
+		State& state = getState();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		if (!state.recording) {
+			return false;
+		}
+		state.recording = false;
+		return write(state);
+	}
+
+	static void setThreadName(const char* name) {
+		getThreadBuffer()->name = name;
+	}
+
+	static void record(char phase, const char* name, uint64_t id = 0) {
+		State& state = getState();
+		if (!state.recording.load(std::memory_order_relaxed)) {
+			return;
+		}
+		ThreadBuffer* buffer = getThreadBuffer();
+		uint32_t session = state.session.load(std::memory_order_acquire);
+		if (buffer->session.load(std::memory_order_relaxed) != session) {
+			if (!buffer->events) {
+				buffer->events.reset(new Event[eventsPerThread]);
+			}
+			buffer->count.store(0, std::memory_order_relaxed);
+			buffer->dropped = 0;
+			buffer->session.store(session, std::memory_order_release);
+		}
+		uint32_t count = buffer->count.load(std::memory_order_relaxed);
+		if (count >= eventsPerThread) {
+			buffer->dropped++;
+			return;
+		}
+		buffer->events[count] = { name, Clock::now(), id, phase };
+		buffer->count.store(count + 1, std::memory_order_release);
+	}
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Event {
+		const char* name;
+		Clock::time_point time;
+		uint64_t id;
+		char phase;
+	};
+
+	// Never freed, so events of threads that have exited can still be written
+	struct ThreadBuffer {
+		int id = 0;
+		const char* name = NULL;
+		std::unique_ptr<Event[]> events;
+		std::atomic<uint32_t> count{ 0 };
+		std::atomic<uint32_t> session{ 0 };
+		uint32_t dropped = 0;
+	};
+
+	struct State {
+		std::mutex mutex;
+		std::vector<std::unique_ptr<ThreadBuffer>> threads;
+		std::atomic<bool> recording{ false };
+		std::atomic<uint32_t> session{ 0 };
+		Clock::time_point epoch;
+		std::string path;
+	};
+
+	static State& getState() {
+		static State state;
+		return state;
+	}
+
+	static ThreadBuffer* getThreadBuffer() {
+		thread_local ThreadBuffer* buffer = NULL;
+		if (!buffer) {
+			State& state = getState();
+			std::lock_guard<std::mutex> lock(state.mutex);
+			state.threads.emplace_back(new ThreadBuffer());
+			buffer = state.threads.back().get();
+			buffer->id = (int)state.threads.size();
+		}
+		return buffer;
+	}
+
+	// Called with the mutex held, which keeps threads from starting a new session meanwhile
+	static bool write(State& state) {
+		FILE* file = fopen(state.path.c_str(), "w");
+		if (!file) {
+			fprintf(stderr, "Could not open %s for writing\n", state.path.c_str());
+			return false;
+		}
+		uint32_t session = state.session.load();
+		size_t written = 0;
+		fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		bool first = true;
+		for (const std::unique_ptr<ThreadBuffer>& buffer : state.threads) {
+			if (buffer->name) {
+				fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+					first ? "" : ",\n", buffer->id, buffer->name);
+				first = false;
+			}
+			if (buffer->session.load(std::memory_order_acquire) != session) {
+				continue;
+			}
+			uint32_t count = buffer->count.load(std::memory_order_acquire);
+			for (uint32_t i = 0; i < count; i++) {
+				const Event& event = buffer->events[i];
+				double microseconds = std::chrono::duration<double, std::micro>(event.time - state.epoch).count();
+				fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"visualizer\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d",
+					first ? "" : ",\n", event.name, event.phase, microseconds, buffer->id);
+				if (event.phase == 's' || event.phase == 'f') {
+					fprintf(file, ",\"id\":%llu%s", (unsigned long long)event.id, event.phase == 'f' ? ",\"bp\":\"e\"" : "");
+				}
+				fprintf(file, "}");
+				first = false;
+			}
+			written += count;
+			if (buffer->dropped > 0) {
+				fprintf(stderr, "Trace: thread %d filled its buffer and dropped %u events\n", buffer->id, buffer->dropped);
+			}
+		}
+		fprintf(file, "\n]}\n");
+		if (fclose(file) != 0) {
+			return false;
+		}
+		fprintf(stderr, "Saved %zu trace events to %s\n", written, state.path.c_str());
+		return true;
+	}
+};
+
+class TraceScope {
+public:
+	TraceScope(const char* aName) : name(aName), began(Trace::isRecording()) {
+		if (began) {
+			Trace::record('B', name);
+		}
+	}
+
+	~TraceScope() {
+		if (began) {
+			Trace::record('E', name);
+		}
+	}
+
+private:
+	const char* name;
+	bool began;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_BEGIN(name) Trace::record('B', name)
+#define TRACE_END(name) Trace::record('E', name)
+#define TRACE_FLOW_START(name, id) Trace::record('s', name, id)
+#define TRACE_FLOW_END(name, id) Trace::record('f', name, id)
+#define TRACE_THREAD_NAME(name) Trace::setThreadName(name)
+
+#else
+
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END(name) ((void)0)
+// Flow ids are still evaluated, so they are computed and used the same way in either build
+#define TRACE_FLOW_START(name, id) ((void)(id))
+#define TRACE_FLOW_END(name, id) ((void)(id))
+#define TRACE_THREAD_NAME(name) ((void)0)
+
+#endif
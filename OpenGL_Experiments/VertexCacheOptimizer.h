@@ -0,0 +1,148 @@
+#pragma once
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+// Triangle reordering for the post-transform vertex cache, after Tom Forsyth's "Linear-Speed
+// Vertex Cache Optimisation". Triangles are emitted greedily by the score of their vertices in
+// a simulated LRU cache, favouring vertices that were just used and vertices with few
+// triangles left, so the mesh is walked in small patches instead of long rows.
+class VertexCacheOptimizer {
+public:
+	// Reorders the triangles of an indexed triangle list in place
+	static void optimize(unsigned short* indices, int indexCount, int vertexCount) {
+		int triangleCount = indexCount / 3;
+		std::vector<Vertex> vertices(vertexCount);
+		for (int i = 0; i < triangleCount * 3; i++) {
+			vertices[indices[i]].remaining++;
+		}
+		// Triangles of each vertex, packed
+		std::vector<int> vertexTriangles(triangleCount * 3);
+		int offset = 0;
+		for (Vertex& vertex : vertices) {
+			vertex.firstTriangle = offset;
+			offset += vertex.remaining;
+			vertex.score = score(vertex);
+		}
+		std::vector<int> filled(vertexCount, 0);
+		for (int t = 0; t < triangleCount; t++) {
+			for (int c = 0; c < 3; c++) {
+				int v = indices[t * 3 + c];
+				vertexTriangles[vertices[v].firstTriangle + filled[v]++] = t;
+			}
+		}
+
+		std::vector<float> triangleScores(triangleCount);
+		std::vector<bool> emitted(triangleCount, false);
+		for (int t = 0; t < triangleCount; t++) {
+			triangleScores[t] = vertices[indices[t * 3]].score + vertices[indices[t * 3 + 1]].score + vertices[indices[t * 3 + 2]].score;
+		}
+
+		std::vector<unsigned short> output;
+		output.reserve(triangleCount * 3);
+		std::vector<int> cache;
+		cache.reserve(cacheSize + 3);
+		int best = -1;
+		int scanFrom = 0;
+		for (int n = 0; n < triangleCount; n++) {
+			if (best < 0) {
+				// Nothing scored in the cache, so start a new patch from the best remaining triangle
+				while (emitted[scanFrom]) {
+					scanFrom++;
+				}
+				best = scanFrom;
+				for (int t = scanFrom; t < triangleCount; t++) {
+					if (!emitted[t] && triangleScores[t] > triangleScores[best]) {
+						best = t;
+					}
+				}
+			}
+
+			emitted[best] = true;
+			for (int c = 0; c < 3; c++) {
+				int v = indices[best * 3 + c];
+				output.push_back((unsigned short)v);
+				Vertex& vertex = vertices[v];
+				// Drop the triangle from the vertex's list
+				int* first = &vertexTriangles[vertex.firstTriangle];
+				std::remove(first, first + vertex.remaining, best);
+				vertex.remaining--;
+				// Move the vertex to the front of the cache
+				auto cached = std::find(cache.begin(), cache.end(), v);
+				if (cached != cache.end()) {
+					cache.erase(cached);
+				}
+				cache.insert(cache.begin(), v);
+			}
+
+			// Rescore everything that was in the cache, including vertices just pushed out
+			for (size_t i = 0; i < cache.size(); i++) {
+				vertices[cache[i]].cachePosition = i < (size_t)cacheSize ? (int)i : -1;
+			}
+			best = -1;
+			float bestScore = -1.0f;
+			for (size_t i = 0; i < cache.size(); i++) {
+				Vertex& vertex = vertices[cache[i]];
+				float delta = score(vertex) - vertex.score;
+				vertex.score += delta;
+				for (int k = 0; k < vertex.remaining; k++) {
+					int t = vertexTriangles[vertex.firstTriangle + k];
+					triangleScores[t] += delta;
+					if (triangleScores[t] > bestScore) {
+						bestScore = triangleScores[t];
+						best = t;
+					}
+				}
+			}
+			if (cache.size() > (size_t)cacheSize) {
+				cache.resize(cacheSize);
+			}
+		}
+		std::copy(output.begin(), output.end(), indices);
+	}
+
+	// Average cache miss ratio: vertex transforms per triangle with a FIFO cache of cacheSize
+	// entries, as most GPUs implement it. 0.5 is the limit for a large regular grid, 3 is no reuse.
+	static double computeAcmr(const unsigned short* indices, int indexCount, int cacheSize = 16) {
+		std::vector<int> fifo(cacheSize, -1);
+		int next = 0;
+		int misses = 0;
+		for (int i = 0; i < indexCount; i++) {
+			if (std::find(fifo.begin(), fifo.end(), indices[i]) == fifo.end()) {
+				fifo[next] = indices[i];
+				next = (next + 1) % cacheSize;
+				misses++;
+			}
+		}
+		return indexCount > 0 ? misses / (indexCount / 3.0) : 0.0;
+	}
+
+private:
+	static const int cacheSize = 32;
+
+	struct Vertex {
+		int firstTriangle = 0;
+		int remaining = 0;
+		int cachePosition = -1;
+		float score = 0.0f;
+	};
+
+	static float score(const Vertex& vertex) {
+		if (vertex.remaining == 0) {
+			return -1.0f;
+		}
+		float value = 0.0f;
+		if (vertex.cachePosition >= 0) {
+			if (vertex.cachePosition < 3) {
+				// The last triangle's vertices score a fixed amount so its neighbours are not
+				// always preferred over the rest of the cache
+				value = 0.75f;
+			}
+			else {
+				value = powf(1.0f - (vertex.cachePosition - 3) / (float)(cacheSize - 3), 1.5f);
+			}
+		}
+		// Vertices with few triangles left are finished first so they can leave the cache
+		return value + 2.0f * powf((float)vertex.remaining, -0.5f);
+	}
+};
@@ -0,0 +1,401 @@
+#pragma once
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include "Trace.h"
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VIDEOSINK_SSE2
+#endif
+
+#ifdef _WIN32
+#define videoSinkPopen(command) _popen(command, "wb")
+#define videoSinkPclose _pclose
+#else
+#include <pthread.h>
+#include <signal.h>
+#define videoSinkPopen(command) popen(command, "w") // POSIX pipes have no binary mode
+#define videoSinkPclose pclose
+#endif
+
+// Converts RGBA frames to YUV420 (full range BT.601) on a pool of worker threads and
+// writes them in order as a Y4M stream to a file, or to a process when the target starts with '|'.
+// Frames come from a fixed pool, so the producer never blocks: if every buffer is still queued
+// behind a slow encoder the frame is dropped and counted instead. Every write happens on the
+// writer thread; if one fails (the encoder exited, the disk is full) the sink stops taking
+// frames and reports the error in its stats.
+class VideoSink {
+public:
+	struct Frame {
+		std::vector<uint8_t> rgba;
+		std::vector<uint8_t> yuv;
+		uint64_t sequence = 0;
+		std::chrono::steady_clock::time_point captureTime;
+	};
+
+	struct Stats {
+		uint64_t submitted = 0;
+		uint64_t written = 0;
+		uint64_t dropped = 0;
+		uint64_t late = 0;
+		int writeError = 0; // errno of the write that stopped the sink, or 0
+	};
+
+	~VideoSink() {
+		close();
+	}
+
+	bool open(const std::string& target, int aWidth, int aHeight, int aFps, bool aBottomUp, int workers = 0, int queueDepth = 4) {
+		close();
+		if (target.empty() || aWidth <= 0 || aHeight <= 0 || aFps <= 0) {
+			return false;
+		}
+		isPipe = target[0] == '|';
+		output = isPipe ? videoSinkPopen(target.c_str() + 1) : fopen(target.c_str(), "wb");
+		if (output == NULL) {
+			fprintf(stderr, "Failed to open video output %s\n", target.c_str());
+			return false;
+		}
+		if (isPipe) {
+			// Unbuffered, so closing the pipe has nothing left to write to an encoder that is gone
+			setvbuf(output, NULL, _IONBF, 0);
+		}
+		fps = aFps;
+		width = aWidth;
+		height = aHeight;
+		bottomUp = aBottomUp;
+		lateThreshold = std::chrono::microseconds(1000000LL * queueDepth / aFps);
+		nextSubmit = 0;
+		nextWrite = 0;
+		submitted = written = dropped = late = 0;
+		writeError = 0;
+		stopping = false;
+		converting = 0;
+
+		int chromaSize = ((width + 1) / 2) * ((height + 1) / 2);
+		frames.resize(queueDepth);
+		for (Frame& frame : frames) {
+			frame.rgba.resize((size_t)width * height * 4);
+			frame.yuv.resize((size_t)width * height + 2 * chromaSize);
+			freeFrames.push_back(&frame);
+		}
+
+		if (workers <= 0) {
+			workers = std::max(1, (int)std::thread::hardware_concurrency() - 2);
+		}
+		for (int i = 0; i < workers; i++) {
+			workerThreads.emplace_back(&VideoSink::convertLoop, this);
+		}
+		writerThread = std::thread(&VideoSink::writeLoop, this);
+		return true;
+	}
+
+	void close() {
+		if (output == NULL) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		convertReady.notify_all();
+		writeReady.notify_all();
+		for (std::thread& worker : workerThreads) {
+			worker.join();
+		}
+		writerThread.join();
+		workerThreads.clear();
+
+		if (isPipe) {
+			videoSinkPclose(output);
+		}
+		else {
+			fclose(output);
+		}
+		output = NULL;
+		freeFrames.clear();
+		convertQueue.clear();
+		converted.clear();
+		frames.clear();
+	}
+
+	bool isOpen() const {
+		return output != NULL;
+	}
+
+	// Whether a write failed, after which the sink only drops frames until it is closed
+	bool hasFailed() const {
+		return writeError != 0;
+	}
+
+	// Returns a free frame to fill with RGBA pixels, or NULL (counted as dropped) when the pool is exhausted
+	Frame* acquireFrame() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (output == NULL || freeFrames.empty() || writeError != 0) {
+			dropped++;
+			return NULL;
+		}
+		Frame* frame = freeFrames.back();
+		freeFrames.pop_back();
+		return frame;
+	}
+
+	void submitFrame(Frame* frame) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			frame->sequence = nextSubmit++;
+			frame->captureTime = std::chrono::steady_clock::now();
+			convertQueue.push_back(frame);
+			submitted++;
+		}
+		convertReady.notify_one();
+	}
+
+	Stats getStats() const {
+		Stats stats;
+		stats.submitted = submitted;
+		stats.written = written;
+		stats.dropped = dropped;
+		stats.late = late;
+		stats.writeError = writeError;
+		return stats;
+	}
+
+	int getWidth() const {
+		return width;
+	}
+
+	int getHeight() const {
+		return height;
+	}
+
+	static void convertRows(const uint8_t* rgba, uint8_t* yuv, int width, int height, int rowBegin, int rowEnd, bool bottomUp) {
+		int chromaWidth = (width + 1) / 2;
+		uint8_t* yPlane = yuv;
+		uint8_t* uPlane = yuv + (size_t)width * height;
+		uint8_t* vPlane = uPlane + (size_t)chromaWidth * ((height + 1) / 2);
+		for (int y = rowBegin; y < rowEnd; y++) {
+			int srcRow = bottomUp ? height - 1 - y : y;
+			const uint8_t* row = rgba + (size_t)srcRow * width * 4;
+			convertRowY(row, yPlane + (size_t)y * width, width);
+			if ((y & 1) == 0) {
+				int nextRow = y + 1 < height ? (bottomUp ? srcRow - 1 : srcRow + 1) : srcRow;
+				size_t chromaOffset = (size_t)(y / 2) * chromaWidth;
+				convertRowUV(row, rgba + (size_t)nextRow * width * 4, uPlane + chromaOffset, vPlane + chromaOffset, width);
+			}
+		}
+	}
+
+private:
+	static inline uint8_t average(uint8_t a, uint8_t b) {
+		return (uint8_t)((a + b + 1) >> 1);
+	}
+
+	static inline uint8_t clampByte(int value) {
+		return (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+	}
+
+#ifdef VIDEOSINK_SSE2
+	// Dot product of 4 RGBA pixels (widened to 16 bit in lo/hi) with a 16 bit coefficient pattern
+	static inline __m128i dotPixels(__m128i lo, __m128i hi, __m128i coeffs) {
+		__m128i a = _mm_madd_epi16(lo, coeffs);
+		__m128i b = _mm_madd_epi16(hi, coeffs);
+		__m128 evens = _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0));
+		__m128 odds = _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(3, 1, 3, 1));
+		return _mm_add_epi32(_mm_castps_si128(evens), _mm_castps_si128(odds));
+	}
+
+	static inline void store4(uint8_t* dst, __m128i values) {
+		values = _mm_packs_epi32(values, values);
+		values = _mm_packus_epi16(values, values);
+		int packed = _mm_cvtsi128_si32(values);
+		memcpy(dst, &packed, 4);
+	}
+#endif
+
+	static void convertRowY(const uint8_t* rgba, uint8_t* dst, int width) {
+		int x = 0;
+#ifdef VIDEOSINK_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i coeffs = _mm_setr_epi16(77, 150, 29, 0, 77, 150, 29, 0);
+		const __m128i round = _mm_set1_epi32(128);
+		for (; x + 4 <= width; x += 4) {
+			__m128i pixels = _mm_loadu_si128((const __m128i*)(rgba + x * 4));
+			__m128i sum = dotPixels(_mm_unpacklo_epi8(pixels, zero), _mm_unpackhi_epi8(pixels, zero), coeffs);
+			store4(dst + x, _mm_srai_epi32(_mm_add_epi32(sum, round), 8));
+		}
+#endif
+		for (; x < width; x++) {
+			const uint8_t* p = rgba + x * 4;
+			dst[x] = (uint8_t)((77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8);
+		}
+	}
+
+	// Averages each 2x2 block of two source rows, then converts to U and V
+	static void convertRowUV(const uint8_t* row0, const uint8_t* row1, uint8_t* u, uint8_t* v, int width) {
+		int x = 0;
+#ifdef VIDEOSINK_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i uCoeffs = _mm_setr_epi16(-43, -85, 128, 0, -43, -85, 128, 0);
+		const __m128i vCoeffs = _mm_setr_epi16(128, -107, -21, 0, 128, -107, -21, 0);
+		const __m128i bias = _mm_set1_epi32((128 << 8) + 128);
+		for (; x + 8 <= width; x += 8) {
+			__m128i a = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(row0 + x * 4)), _mm_loadu_si128((const __m128i*)(row1 + x * 4)));
+			__m128i b = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(row0 + x * 4 + 16)), _mm_loadu_si128((const __m128i*)(row1 + x * 4 + 16)));
+			__m128i ha = _mm_avg_epu8(_mm_shuffle_epi32(a, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 3, 1)));
+			__m128i hb = _mm_avg_epu8(_mm_shuffle_epi32(b, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 3, 1)));
+			__m128i pixels = _mm_unpacklo_epi64(ha, hb);
+			__m128i lo = _mm_unpacklo_epi8(pixels, zero);
+			__m128i hi = _mm_unpackhi_epi8(pixels, zero);
+			store4(u + x / 2, _mm_srai_epi32(_mm_add_epi32(dotPixels(lo, hi, uCoeffs), bias), 8));
+			store4(v + x / 2, _mm_srai_epi32(_mm_add_epi32(dotPixels(lo, hi, vCoeffs), bias), 8));
+		}
+#endif
+		for (; x < width; x += 2) {
+			int x1 = x + 1 < width ? x + 1 : x;
+			int c[3];
+			for (int i = 0; i < 3; i++) {
+				c[i] = average(average(row0[x * 4 + i], row1[x * 4 + i]), average(row0[x1 * 4 + i], row1[x1 * 4 + i]));
+			}
+			u[x / 2] = clampByte(((-43 * c[0] - 85 * c[1] + 128 * c[2] + 128) >> 8) + 128);
+			v[x / 2] = clampByte(((128 * c[0] - 107 * c[1] - 21 * c[2] + 128) >> 8) + 128);
+		}
+	}
+
+	void convertLoop() {
+		TRACE_THREAD_NAME("video convert");
+		while (true) {
+			Frame* frame;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				convertReady.wait(lock, [this] { return stopping || !convertQueue.empty(); });
+				if (convertQueue.empty()) {
+					return;
+				}
+				frame = convertQueue.front();
+				convertQueue.pop_front();
+				converting++;
+			}
+			{
+				TRACE_SCOPE("convertFrame");
+				convertRows(frame->rgba.data(), frame->yuv.data(), width, height, 0, height, bottomUp);
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				converted[frame->sequence] = frame;
+				converting--;
+			}
+			writeReady.notify_one();
+		}
+	}
+
+	// Writes all of data, or records errno and returns false
+	bool writeAll(const void* data, size_t size) {
+		errno = 0;
+		if (fwrite(data, 1, size, output) == size) {
+			return true;
+		}
+		return writeFailed();
+	}
+
+	bool writeFailed() {
+		int error = errno != 0 ? errno : EIO;
+		writeError = error;
+		fprintf(stderr, "Video output stopped: %s\n", strerror(error));
+		return false;
+	}
+
+	void writeLoop() {
+		TRACE_THREAD_NAME("video writer");
+#ifndef _WIN32
+		// A closed pipe then fails the write with EPIPE instead of killing the process
+		sigset_t pipeSignal;
+		sigemptyset(&pipeSignal);
+		sigaddset(&pipeSignal, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &pipeSignal, NULL);
+#endif
+		char header[96];
+		int headerSize = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, fps);
+		bool writing = writeAll(header, headerSize);
+		while (writing) {
+			Frame* frame;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				writeReady.wait(lock, [this] {
+					return converted.count(nextWrite) > 0 || (stopping && convertQueue.empty() && converting == 0 && converted.empty());
+				});
+				auto it = converted.find(nextWrite);
+				if (it == converted.end()) {
+					break;
+				}
+				frame = it->second;
+				converted.erase(it);
+			}
+			{
+				TRACE_SCOPE("writeFrame");
+				writing = writeAll("FRAME\n", 6) && writeAll(frame->yuv.data(), frame->yuv.size());
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (writing) {
+					if (std::chrono::steady_clock::now() - frame->captureTime > lateThreshold) {
+						late++;
+					}
+					written++;
+				}
+				else {
+					dropped++;
+				}
+				nextWrite++;
+				freeFrames.push_back(frame);
+			}
+			// Wake the writer again in case later frames finished converting first
+			writeReady.notify_one();
+		}
+		errno = 0;
+		if (writing && fflush(output) != 0) {
+			writeFailed();
+		}
+	}
+
+	FILE* output = NULL;
+	bool isPipe = false;
+	int width = 0;
+	int height = 0;
+	int fps = 0;
+	bool bottomUp = false;
+	std::chrono::microseconds lateThreshold;
+
+	std::mutex mutex;
+	std::condition_variable convertReady;
+	std::condition_variable writeReady;
+	bool stopping = false;
+	std::vector<Frame> frames;
+	std::vector<Frame*> freeFrames;
+	std::deque<Frame*> convertQueue;
+	std::map<uint64_t, Frame*> converted;
+	int converting = 0;
+	uint64_t nextSubmit = 0;
+	uint64_t nextWrite = 0;
+
+	std::atomic<uint64_t> submitted{ 0 };
+	std::atomic<uint64_t> written{ 0 };
+	std::atomic<uint64_t> dropped{ 0 };
+	std::atomic<uint64_t> late{ 0 };
+	std::atomic<int> writeError{ 0 };
+
+	std::vector<std::thread> workerThreads;
+	std::thread writerThread;
+};
@@ -0,0 +1,145 @@
+#pragma once
+#include <stdio.h>
+#include <atomic>
+#include <vector>
+#include <GL/glew.h>
+
+// Compares the GPU time of the wireframe modes. While running, it picks the mode for each frame
+// (framesPerMode frames of each in turn) and times the terrain draws with GL_TIME_ELAPSED
+// queries. Query results are collected a few frames later so the benchmark never stalls the
+// pipeline it is measuring. If the GPU falls queryCount frames behind, the next frame is drawn
+// untimed instead of reusing a query still in flight, so every mode is averaged over exactly
+// framesPerMode timed frames.
+class WireframeBenchmark {
+public:
+	static const int maxModes = 4;
+
+	WireframeBenchmark(int aModeCount) {
+		modeCount = aModeCount < maxModes ? aModeCount : maxModes;
+	}
+
+	// May be called from any thread; the benchmark starts on the next frame
+	void request(int framesPerMode) {
+		requestedFrames = framesPerMode;
+	}
+
+	bool isRunning() const {
+		return running;
+	}
+
+	// Average GPU milliseconds per frame for a mode from the last finished run
+	double getAverage(int mode) const {
+		return mode >= 0 && mode < modeCount ? averages[mode].load() : 0.0;
+	}
+
+	// Returns the mode to draw this frame, or defaultMode when no benchmark is running
+	int beginFrame(int defaultMode) {
+		int frames = requestedFrames.exchange(0);
+		if (frames > 0 && !running) {
+			start(frames);
+		}
+		if (!running) {
+			return defaultMode;
+		}
+		collect(false);
+		if (frame >= framesPerMode * modeCount) {
+			return defaultMode;
+		}
+		int mode = frame / framesPerMode;
+		Query& query = queries[frame % queryCount];
+		timing = !query.pending;
+		if (timing) {
+			query.mode = mode;
+			query.pending = true;
+			glBeginQuery(GL_TIME_ELAPSED, query.id);
+		}
+		else {
+			skippedFrames++;
+		}
+		return mode;
+	}
+
+	void endFrame() {
+		if (!running) {
+			return;
+		}
+		if (frame < framesPerMode * modeCount) {
+			if (timing) {
+				glEndQuery(GL_TIME_ELAPSED);
+				frame++;
+			}
+		}
+		else {
+			finish();
+		}
+	}
+
+private:
+	static const int queryCount = 8;
+
+	struct Query {
+		GLuint id = 0;
+		int mode = 0;
+		bool pending = false;
+	};
+
+	void start(int frames) {
+		if (queries[0].id == 0) {
+			for (Query& query : queries) {
+				glGenQueries(1, &query.id);
+			}
+		}
+		framesPerMode = frames;
+		frame = 0;
+		skippedFrames = 0;
+		totals.assign(modeCount, 0.0);
+		counts.assign(modeCount, 0);
+		running = true;
+	}
+
+	// Reads back finished queries; with wait set, blocks until all are available
+	void collect(bool wait) {
+		for (Query& query : queries) {
+			if (!query.pending) {
+				continue;
+			}
+			GLint available = GL_FALSE;
+			if (!wait) {
+				glGetQueryObjectiv(query.id, GL_QUERY_RESULT_AVAILABLE, &available);
+			}
+			if (wait || available) {
+				GLuint64 nanoseconds = 0;
+				glGetQueryObjectui64v(query.id, GL_QUERY_RESULT, &nanoseconds);
+				totals[query.mode] += nanoseconds / 1.0e6;
+				counts[query.mode]++;
+				query.pending = false;
+			}
+		}
+	}
+
+	void finish() {
+		collect(true);
+		fprintf(stderr, "Wireframe benchmark (GPU ms per frame):");
+		for (int mode = 0; mode < modeCount; mode++) {
+			averages[mode] = counts[mode] > 0 ? totals[mode] / counts[mode] : 0.0;
+			fprintf(stderr, " mode %d: %.3f", mode, averages[mode].load());
+		}
+		if (skippedFrames > 0) {
+			fprintf(stderr, " (%d frames untimed while the GPU caught up)", skippedFrames);
+		}
+		fprintf(stderr, "\n");
+		running = false;
+	}
+
+	int modeCount;
+	Query queries[queryCount];
+	int framesPerMode = 0;
+	int frame = 0; // timed frames so far
+	int skippedFrames = 0;
+	bool timing = false; // whether this frame's query was begun
+	bool running = false;
+	std::vector<double> totals;
+	std::vector<int> counts;
+	std::atomic<double> averages[maxModes] = {};
+	std::atomic<int> requestedFrames{ 0 };
+};
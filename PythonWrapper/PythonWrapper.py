@@ -26,35 +26,6 @@ stream = p.open(
     input_device_index=deviceIndex # virtual audio cable index is 2
 )
 
-bars = 3
-logBins = np.linspace(0,  np.log10(CHUNK / 2 + 1), bars)
-bins = (10**logBins).astype(int)
-for i in range(1, len(bins)):
-    if i==0: continue
-    if bins[i] == bins[i-1]:
-        for j in range(i, len(bins)):
-            bins[j] += 1
-
-bins = [5, 41, 883] # 100 Hz, 1000 Hz, and above 1000 Hz
-print(bins)
-
-def sumBins(dat, b):
-    binVals = []
-    index = 0
-    amt = 0
-    m = 0
-    for i in b:
-        if index == i: continue
-        jndex = index
-        amt = 0
-        while index < i and index < len(dat):
-            amt +=  dat[index]
-            m = max(m, dat[index])
-            index += 1
-        amt /= index-jndex
-        binVals.append( (amt + m) / 2 )
-    return binVals
-
 print('program running. stop with ctrl-c')
 
 bin0av = 0
@@ -64,9 +35,10 @@ bin2av = 0
 try:
     while True:
         dataString = stream.read(CHUNK)
+        captureTime = gl.getClockTime()
         data = np.divide( struct.unpack(str(CHUNK) + 'h', dataString), 32768.0 )
-        data_int = np.log10(np.abs( np.fft.fft(data) ))
-        binVals = sumBins(data_int, bins)
+        # log10 |FFT| summed into bands below 100 Hz, 100 to 1000 Hz and above 1000 Hz
+        binVals = gl.analyzeAudio(data.tolist(), CHUNK, RATE)[0]
 
         if (bin0av < 0):
             bin0av = 0
@@ -83,7 +55,8 @@ try:
         gl.setMountainHeight(
             max(bin0av - 1.0, 0.0),
             max(bin1av, 0.0),
-            max(bin2av, 0.0)
+            max(bin2av, 0.0),
+            captureTime
         )
 
 except KeyboardInterrupt: